@@ -45,6 +45,8 @@ make_conn(int fd, char start_state, tube use, tube watch)
     TUBE_ASSIGN(c->use, use);
     use->using_ct++;
 
+    c->cmd = c->cmd_buf;
+    c->cmd_size = LINE_BUF_SIZE;
     c->sock.fd = fd;
     c->state = start_state;
     c->pending_timeout = -1;
@@ -112,12 +114,15 @@ conntickat(Conn *c)
     int margin = 0, should_timeout = 0;
     int64 t = INT64_MAX;
 
+    // a kick in progress has more to do right away
+    if (c->kick_left) return nanoseconds();
+
     if (conn_waiting(c)) {
         margin = SAFETY_MARGIN;
     }
 
     if (has_reserved_job(c)) {
-        t = connsoonestjob(c)->r.deadline_at - nanoseconds() - margin;
+        t = c->deadlines.data[0].key - nanoseconds() - margin;
         should_timeout = 1;
     }
     if (c->pending_timeout >= 0) {
@@ -158,16 +163,7 @@ connsched(Conn *c)
 job
 connsoonestjob(Conn *c)
 {
-    job j = NULL;
-    job soonest = c->soonest_job;
-
-    if (soonest == NULL) {
-        for (j = c->reserved_jobs.next; j != &c->reserved_jobs; j = j->next) {
-            if (j->r.deadline_at <= (soonest ? : j)->r.deadline_at) soonest = j;
-        }
-    }
-    c->soonest_job = soonest;
-    return soonest;
+    return c->deadlines.len ? c->deadlines.data[0].j : NULL;
 }
 
 
@@ -225,6 +221,13 @@ connclose(Conn *c)
     c->in_job = c->out_job = NULL;
     c->in_job_read = 0;
 
+    free(c->out_buf);
+    if (c->cmd != c->cmd_buf) free(c->cmd);
+
+    /* a put-batch still coming in? */
+    while (c->batch_read) job_free(c->batch[--c->batch_read]);
+    free(c->batch);
+
     if (c->type & CONN_TYPE_PRODUCER) cur_producer_ct--; /* stats */
     if (c->type & CONN_TYPE_WORKER) cur_worker_ct--; /* stats */
 
@@ -234,6 +237,8 @@ connclose(Conn *c)
     if (has_reserved_job(c)) enqueue_reserved_jobs(c);
 
     ms_clear(&c->watch);
+    free(c->waiters);
+    free(c->deadlines.data);
     c->use->using_ct--;
     TUBE_ASSIGN(c->use, NULL);
 
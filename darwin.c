@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -10,12 +12,18 @@
 
 enum
 {
-    Infinity = 1 << 30
+    Infinity = 1 << 30,
+    Nevent = 128 /* max events taken from one kevent call */
 };
 
 static int  kq;
 static char buf0[512]; /* buffer of zeros */
 
+/* Events from the last kevent call not yet returned by socknext.
+ * An entry's udata is NULL if its socket was removed meanwhile. */
+static struct kevent evs[Nevent];
+static int nev, iev;
+
 
 /* Allocate disk space.
  * Expects fd's offset to be 0; may also reset fd's offset to 0.
@@ -36,6 +44,56 @@ rawfalloc(int fd, int len)
 }
 
 
+/* Send n bytes at offset off in file in to socket out.
+ * Returns the number of bytes sent, or -1 on error.
+ * The native sendfile calls differ here, so copy through a buffer. */
+int
+rawsendfile(int out, int in, int off, int n)
+{
+    char buf[16 << 10];
+    int r;
+
+    r = pread(in, buf, min(n, sizeof buf), off);
+    if (r <= 0) return r;
+    return write(out, buf, r);
+}
+
+
+/* Start an fsync of fd that runs in the background, if we can.
+ * Returns 1 if so, or 0 if the caller should call fsync itself. */
+int
+rawsyncstart(int fd)
+{
+    return 0;
+}
+
+
+/* Never called here, since rawsyncstart never starts one. */
+int
+rawsyncdone(void)
+{
+    return 1;
+}
+
+
+/* Accept a connection on listening socket fd, already nonblocking.
+ * Returns the new fd, or -1 on error. */
+int
+rawaccept(int fd)
+{
+    int cfd, flags;
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd == -1) return -1;
+    flags = fcntl(cfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(cfd);
+        return -1;
+    }
+    return cfd;
+}
+
+
 int
 sockinit(void)
 {
@@ -51,10 +109,16 @@ sockinit(void)
 int
 sockwant(Socket *s, int rw)
 {
-    int n = 0;
-    struct kevent evs[2] = {}, *ev = evs;
+    int i, n = 0;
+    struct kevent chs[2] = {}, *ev = chs;
     struct timespec ts = {};
 
+    if (!rw) {
+        for (i = iev; i < nev; i++) {
+            if (evs[i].udata == s) evs[i].udata = NULL;
+        }
+    }
+
     if (s->added) {
         ev->ident = s->fd;
         ev->filter = s->added;
@@ -85,31 +149,40 @@ sockwant(Socket *s, int rw)
         n++;
     }
 
-    return kevent(kq, evs, n, NULL, 0, &ts);
+    return kevent(kq, chs, n, NULL, 0, &ts);
 }
 
 
+// Socknext returns the next event from the current batch. If the batch
+// is used up, it first waits up to timeout for a new one.
 int
 socknext(Socket **s, int64 timeout)
 {
     int r;
-    struct kevent ev;
+    struct kevent *ev;
     static struct timespec ts;
 
-    ts.tv_sec = timeout / 1000000000;
-    ts.tv_nsec = timeout % 1000000000;
-    r = kevent(kq, NULL, 0, &ev, 1, &ts);
-    if (r == -1 && errno != EINTR) {
-        twarn("kevent");
-        return -1;
+    if (iev == nev) {
+        iev = nev = 0;
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+        r = kevent(kq, NULL, 0, evs, Nevent, &ts);
+        if (r == -1 && errno != EINTR) {
+            twarn("kevent");
+            return -1;
+        }
+        if (r > 0) nev = r;
     }
 
-    if (r > 0) {
-        *s = ev.udata;
-        if (ev.flags & EV_EOF) {
+    while (iev < nev) {
+        ev = &evs[iev++];
+        if (!ev->udata) continue;
+
+        *s = ev->udata;
+        if (ev->flags & EV_EOF) {
             return 'h';
         }
-        switch (ev.filter) {
+        switch (ev->filter) {
         case EVFILT_READ:
             return 'r';
         case EVFILT_WRITE:
@@ -118,3 +191,11 @@ socknext(Socket **s, int64 timeout)
     }
     return 0;
 }
+
+
+// Sockpending returns 1 if the current batch has events left.
+int
+sockpending(void)
+{
+    return iev < nev;
+}
@@ -22,11 +22,18 @@ typedef struct job    *job;
 typedef struct tube   *tube;
 typedef struct Conn   Conn;
 typedef struct Heap   Heap;
+typedef struct Jobent Jobent;
+typedef struct Jobheap Jobheap;
 typedef struct Jobrec Jobrec;
+typedef struct Walrec Walrec;
+typedef struct Jobct  Jobct;
 typedef struct File   File;
 typedef struct Socket Socket;
 typedef struct Server Server;
 typedef struct Wal    Wal;
+typedef struct Waiter Waiter;
+typedef struct Hist   Hist;
+typedef struct Snap   Snap;
 
 typedef void(*ms_event_fn)(ms a, void *item, size_t i);
 typedef void(*Handle)(void*, int rw);
@@ -34,12 +41,6 @@ typedef int(*Less)(void*, void*);
 typedef void(*Record)(void*, int);
 typedef int(FAlloc)(int, int);
 
-#if _LP64
-#define NUM_PRIMES 48
-#else
-#define NUM_PRIMES 19
-#endif
-
 #define MAX_TUBE_NAME_LEN 201
 
 /* A command can be at most LINE_BUF_SIZE chars, including "\r\n". This value
@@ -47,6 +48,14 @@ typedef int(FAlloc)(int, int);
  * or reply line ("USING a{200}\r\n"). */
 #define LINE_BUF_SIZE 224
 
+/* The longest command line allowed for the batch commands that take a list
+ * of job ids ("delete-batch 1 2 3 ...\r\n"). */
+#define BATCH_LINE_SIZE (64 * 1024)
+
+/* Replies to pipelined commands are collected in a per-connection buffer of
+ * this many bytes, and written out together. */
+#define OUT_BUF_SIZE 8192
+
 /* CONN_TYPE_* are bit masks */
 #define CONN_TYPE_PRODUCER 1
 #define CONN_TYPE_WORKER   2
@@ -82,10 +91,51 @@ struct Heap {
     Less    less;
     Record  rec;
 };
+int   heapgrow(Heap *h, int n);
 int   heapinsert(Heap *h, void *x);
 void* heapremove(Heap *h, int k);
 
 
+/* A Jobheap orders jobs by (key, id), where key is the job's priority in
+ * a ready heap or its deadline in a delay heap. The key is copied into the
+ * array so comparisons don't have to touch the jobs themselves. */
+struct Jobent {
+    int64   key;
+    uint64  id;
+    job     j;
+};
+
+struct Jobheap {
+    int     cap;
+    int     len;
+    Jobent  *data;
+};
+int jobheapgrow(Jobheap *h, int n);
+int jobheapinsert(Jobheap *h, job j, int64 key);
+void jobheappush(Jobheap *h, job j, int64 key);
+void jobheapfix(Jobheap *h, int k);
+void jobheapupdate(Jobheap *h, int k, int64 key);
+job jobheapremove(Jobheap *h, int k);
+
+
+/* A Hist is a histogram of durations in nanoseconds; see hist.c. */
+enum {
+    Histsubbits = 3,
+    Histsub = 1 << Histsubbits,
+    Histbits = 40,
+    Histn = (Histbits - Histsubbits + 1) * Histsub,
+};
+
+struct Hist {
+    uint64  n;
+    int64   max;
+    uint64  ct[Histn];
+};
+void  histadd(Hist *h, int64 v);
+int64 histpct(Hist *h, double q);
+int   fmthist(char *buf, size_t size, int n, const char *name, Hist *h);
+
+
 struct Socket {
     int    fd;
     Handle f;
@@ -95,16 +145,18 @@ struct Socket {
 int sockinit(void);
 int sockwant(Socket*, int);
 int socknext(Socket**, int64);
+int sockpending(void);
 
 struct ms {
     size_t used, cap, last;
     void **items;
     ms_event_fn oninsert, onremove;
+    ms_event_fn onmove; /* an item was moved to a new index */
 };
 
 enum
 {
-    Walver = 7
+    Walver = 8
 };
 
 enum // Jobrec.state
@@ -118,12 +170,13 @@ enum // Jobrec.state
 };
 
 // if you modify this struct, you must increment Walver above
-struct Jobrec {
+struct Walrec {
     uint64 id;
     uint32 pri;
     int64  delay;
     int64  ttr;
     int32  body_size;
+    int32  raw_size; // in what was version 7's padding
     int64  created_at;
     int64  deadline_at;
     uint32 reserve_ct;
@@ -134,37 +187,70 @@ struct Jobrec {
     byte   state;
 };
 
+/* The in-memory copy of a job's Walrec, reordered so it has no padding. */
+struct Jobrec {
+    uint64 id;
+    int64  delay;
+    int64  ttr;
+    int64  created_at;
+    int64  deadline_at;
+    uint32 pri;
+    int32  body_size;
+    int32  raw_size; /* body_size before compression; 0 if not compressed */
+    byte   state;
+};
+
+/* A job's counts for stats-job, kept out of line since a job waiting in
+ * a queue has none yet; see job_ct. */
+struct Jobct {
+    uint32 reserve_ct;
+    uint32 timeout_ct;
+    uint32 release_ct;
+    uint32 bury_ct;
+    uint32 kick_ct;
+};
+
+/* Count f of job j, or 0 if it has none. */
+#define JOBCT(j, f) ((j)->ct ? (j)->ct->f : 0)
+
 struct job {
     Jobrec r; // persistent fields; these get written to the wal
 
     /* bookeeping fields; these are in-memory only */
-    char pad[6];
     tube tube;
     job prev, next; /* linked list of jobs */
-    job ht_next; /* Next job in a hash table list */
-    size_t heap_index; /* where is this job in its current heap */
+    void *reserver;
     File *file;
     job  fnext;
     job  fprev;
-    void *reserver;
+    Jobct *ct; /* NULL until something is counted */
+    int heap_index; /* where is this job in its current heap */
     int walresv;
     int walused;
+    int body_off; /* where the body is in file, if written there */
+    int pool; /* size class this was allocated from, or -1 */
+    int64 reserved_at; /* when this job was last reserved */
 
-    char body[]; // written separately to the wal
+    char *body; // written separately to the wal; NULL if only there
 };
 
 struct tube {
     uint refs;
+    uint32 hash; /* of name; see tube_find */
     char name[MAX_TUBE_NAME_LEN];
-    Heap ready;
-    Heap delay;
-    struct ms waiting; /* set of conns */
+    Jobheap ready;
+    Jobheap delay;
+    struct ms waiting; /* set of Waiters */
+    int readypos; /* position in the ready-tube index, or -1 */
+    int delaypos; /* position in the delay-tube index, or -1 */
     struct stats stat;
     uint using_ct;
     uint watching_ct;
     int64 pause;
     int64 deadline_at;
     struct job buried;
+    Hist *waithist; /* put to first reserve; made on first use */
+    Hist *runhist;  /* reserve to delete; made on first use */
 };
 
 
@@ -184,12 +270,17 @@ extern const char *progname;
 
 int64 nanoseconds(void);
 int   rawfalloc(int fd, int len);
+int   rawsendfile(int out, int in, int off, int n);
+int   rawsyncstart(int fd);
+int   rawsyncdone(void);
+int   rawaccept(int fd);
 
 
 void ms_init(ms a, ms_event_fn oninsert, ms_event_fn onremove);
 void ms_clear(ms a);
 int ms_append(ms a, void *item);
 int ms_remove(ms a, void *item);
+int ms_delete(ms a, size_t i);
 int ms_contains(ms a, void *item);
 void *ms_take(ms a);
 
@@ -210,6 +301,13 @@ int job_pri_less(void*, void*);
 int job_delay_less(void*, void*);
 
 job job_copy(job j);
+Jobct *job_ct(job j);
+
+int job_bodysize(job j);
+int job_readbody(job j, char *buf);
+int job_loadbody(job j);
+int job_dropbody(job j);
+void job_zip(job j);
 
 const char * job_state(job j);
 
@@ -218,6 +316,8 @@ job job_remove(job j);
 void job_insert(job head, job j);
 
 uint64 total_jobs(void);
+uint64 job_reserve_ids(int n);
+void   job_pool_stats(size_t *bytes, size_t *used, size_t *nfree);
 
 /* for unit tests */
 size_t get_all_jobs_used(void);
@@ -241,13 +341,12 @@ int count_cur_producers(void);
 int count_cur_workers(void);
 
 
-extern size_t primes[];
-
-
 extern size_t job_data_size_limit;
+extern size_t job_zip_min;
 
 void prot_init(void);
 int64 prottick(Server *s);
+void protflush(Server *s);
 
 Conn *remove_waiting_conn(Conn *c);
 
@@ -255,6 +354,7 @@ void enqueue_reserved_jobs(Conn *c);
 
 void enter_drain_mode(int sig);
 void h_accept(const int fd, const short which, Server* srv);
+int  prot_add_tube(tube t);
 void prot_remove_tube(tube t);
 int  prot_replay(Server *s, job list);
 
@@ -267,24 +367,36 @@ struct Conn {
     Socket sock;
     char   state;
     char   type;
+    char   dirty;       // on the dirty list, through next
+    char   held;        // reply held until the wal is flushed; see hold
     Conn   *next;
+    Conn   *hnext;      // next on the held list
     tube   use;
     int64  tickat;      // time at which to do more work
     int    tickpos;     // position in srv->conns
-    job    soonest_job; // memoization of the soonest job
     int    rw;          // currently want: 'r', 'w', or 'h'
     int    pending_timeout;
     char   halfclosed;
+    char   binary;      // speaks the binary protocol; see dispatch_bin
 
-    char cmd[LINE_BUF_SIZE]; // this string is NOT NUL-terminated
+    char *cmd; // this string is NOT NUL-terminated; cmd_buf or a larger buffer
+    int  cmd_size; // bytes available at cmd
     int  cmd_len;
     int  cmd_read;
+    char cmd_buf[LINE_BUF_SIZE];
 
     char *reply;
     int  reply_len;
     int  reply_sent;
     char reply_buf[LINE_BUF_SIZE]; // this string IS NUL-terminated
 
+    // Replies held back so that those of several pipelined commands
+    // go out in one write; see conn_coalesce. They precede any reply
+    // in c->reply.
+    char *out_buf;
+    int  out_len;
+    int  out_sent;
+
     // How many bytes of in_job->body have been read so far. If in_job is NULL
     // while in_job_read is nonzero, we are in bit bucket mode and
     // in_job_read's meaning is inverted -- then it counts the bytes that
@@ -295,8 +407,36 @@ struct Conn {
     job out_job;
     int out_job_sent;
 
+    int reserve_max; // jobs wanted by a waiting reserve-batch, or 0
+
+    // A kick spread over several passes of the event loop; see kick_more.
+    uint kick_left;   // jobs still to kick
+    uint kick_ct;     // jobs kicked so far
+    char kick_buried; // kicking buried jobs, not delayed ones
+
+    // A put-batch in progress. Batch holds the jobs read so far, or NULL
+    // in place of a body that was thrown away; see batch_line.
+    job    *batch;
+    int    batch_ct;   // jobs in the batch
+    int    batch_read; // bodies read so far
+    char   *batch_err; // reply for a batch that failed, or NULL
+    uint64 batch_id;   // id of the first job
+    uint   batch_pri;
+    int64  batch_delay;
+    int64  batch_ttr;
+
     struct ms  watch;
+    Waiter     *waiters; /* parallel to watch, used while waiting */
+    size_t     waiters_cap;
     struct job reserved_jobs; // linked list header
+    Jobheap    deadlines;     // the same jobs, by deadline
+};
+
+/* A conn's entry in the waiting set of one of the tubes it watches. It
+ * tracks its own index there, so the conn can be removed without a search. */
+struct Waiter {
+    Conn    *c;
+    size_t  pos; /* or -1 if not in the set */
 };
 int  connless(Conn *a, Conn *b);
 void connrec(Conn *c, int i);
@@ -335,13 +475,42 @@ struct Wal {
     int64  syncrate;
     int64  lastsync;
     int    nocomp; // disable binlog compaction?
+    int64  syncrec; // nrec as of the last fsync
+    int64  syncing; // nrec as of the fsync running in the background, or 0
+    int    bigbody; // keep bodies this big only on disk; 0 means never
+    int    spill; // drop bodies of buried and long-delayed jobs from memory?
+    int64  spilldelay; // what counts as long, in nanoseconds
+    int64  compbudget; // bytes per second compaction may move; 0 = no limit
+    int64  comptokens; // bytes compaction may move now; see walmaint
+    int64  comptime;   // when comptokens was last topped up
+    int64  nmigbytes;  // bytes migrated ever
+    int64  migrate_rate; // bytes migrated in the last full second
+    int64  ratebytes;  // bytes migrated so far this second
+    int64  ratetime;   // start of this second
+    Hist   writehist; // walwrite
+    Hist   flushhist; // write(2) in walflush
+    Hist   synchist;  // fsync
+    int    nspare;  // spare files to keep ready; 0 means none
+    int    nspares; // spare files ready now
+    File   *spare;  // next files to use, already falloc'd; see walmaint
+    int64  snapsize;  // write a snapshot after this many bytes of log; 0 = never
+    int64  snapbytes; // bytes logged since the last snapshot
+    int64  nsnap;     // snapshots written
+    int    snappid;   // process writing a snapshot, or 0; see snapstart
 };
 int  waldirlock(Wal*);
 void walinit(Wal*, job list);
 int  walwrite(Wal*, job);
-void walmaint(Wal*);
+int64 walmaint(Wal*);
+double waldeadratio(Wal*);
+void walflush(Wal*);
+int  walpending(Wal*);
+void walspill(Wal*, job);
+void walunspill(Wal*, job);
 int  walresvput(Wal*, job);
+int  walresvputn(Wal*, job*, int);
 int  walresvupdate(Wal*, job);
+int  walresvupdaten(Wal*, job*, int);
 void walgc(Wal*);
 
 
@@ -355,6 +524,13 @@ struct File {
     int  resv;
     char *path;
     Wal  *w;
+    char *wbuf; // records not yet written; see filewrite
+    int  wlen;
+    char *rmap; // file contents, while replaying; see fileread
+    int  rlen;
+    int  rpos;
+    int  wpos; // bytes written, including those still in wbuf
+    int  rfd;  // for reading job bodies back; see filerfd
 
     struct job jlist; // jobs written in this file
 };
@@ -364,11 +540,31 @@ void fileincref(File*);
 void filedecref(File*);
 void fileaddjob(File*, job);
 void filermjob(File*, job);
-int  fileread(File*, job list);
+int  fileread(File*, job list, int off);
 void filewopen(File*);
 void filewclose(File*);
+int  filewflush(File*);
 int  filewrjobshort(File*, job);
 int  filewrjobfull(File*, job);
+int  filerfd(File*);
+int  filepread(File*, void*, int, int);
+void towal(Walrec*, job);
+void fromwal(job, Walrec*);
+
+
+// A snapshot file being read; see snap.c.
+struct Snap {
+    char *map;
+    int  len;
+    int  pos;
+    int  seq; // it leaves off at offset off in binlog.seq
+    int  off;
+};
+int  snapstart(Wal*);
+int  snapdone(Wal*);
+int  snapopen(Snap*, Wal*);
+void snapload(Snap*, Wal*, job list);
+void snapclose(Snap*);
 
 
 #define Portdef "11300"
@@ -381,6 +577,8 @@ struct Server {
     Wal    wal;
     Socket sock;
     Heap   conns;
+    Hist   tickhist;  /* prottick, walmaint, walflush and protflush, each pass */
+    Hist   eventhist; /* handling one event */
 };
 void srvserve(Server *srv);
 void srvaccept(Server *s, int ev);
@@ -7,13 +7,16 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include "dat.h"
 
+static int  readall(File*, job, int);
 static int  readrec(File*, job, int*);
 static int  readrec5(File*, job, int*);
+static int  fileget(File*, void*, int);
 static int  readfull(File*, void*, int, int*, char*);
 static void warnpos(File*, int, char*, ...)
 __attribute__((format(printf, 3, 4)));
@@ -22,7 +25,9 @@ FAlloc *falloc = &rawfalloc;
 
 enum
 {
-    Walver5 = 5
+    Walver5 = 5,
+    Walver7 = 7, // as Walver, but it never set Walrec.raw_size
+    Wbufsize = 64 << 10, // bytes of records held before a write
 };
 
 typedef struct Jobrec5 Jobrec5;
@@ -101,34 +106,141 @@ filermjob(File *f, job j)
 }
 
 
-// Fileread reads jobs from f->path into list.
+// Fileread reads jobs from f->path into list, starting with
+// the record at offset off, or the first one if off is 0.
 // It returns 0 on success, or 1 if any errors occurred.
+// The file is mapped into memory for the duration, so
+// records are parsed without a syscall per field.
 int
-fileread(File *f, job list)
+fileread(File *f, job list, int off)
+{
+    struct stat st;
+
+    if (fstat(f->fd, &st) == 0 && st.st_size > 0) {
+        f->rmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+        if (f->rmap == MAP_FAILED) {
+            // fall back to read(2)
+            f->rmap = NULL;
+        } else {
+            f->rlen = st.st_size;
+            f->rpos = 0;
+            (void)madvise(f->rmap, f->rlen, MADV_SEQUENTIAL);
+        }
+    }
+
+    // readall unmaps f; its last decref can free f
+    return readall(f, list, off);
+}
+
+
+static void
+fileunmap(File *f)
+{
+    if (f->rmap) {
+        munmap(f->rmap, f->rlen);
+        f->rmap = NULL;
+    }
+}
+
+
+static int
+readall(File *f, job list, int off)
 {
     int err = 0, v;
 
     if (!readfull(f, &v, sizeof(v), &err, "version")) {
+        fileunmap(f);
         return err;
     }
+    if (off > sizeof(v)) {
+        if (f->rmap) {
+            f->rpos = min(off, f->rlen);
+        } else {
+            lseek(f->fd, off, SEEK_SET);
+        }
+    }
     switch (v) {
+    case Walver7:
+        // its writers left zeroes in the padding where raw_size now is
     case Walver:
         fileincref(f);
         while (readrec(f, list, &err));
+        fileunmap(f);
         filedecref(f);
         return err;
     case Walver5:
         fileincref(f);
         while (readrec5(f, list, &err));
+        fileunmap(f);
         filedecref(f);
         return err;
     }
 
     warnx("%s: unknown version: %d", f->path, v);
+    fileunmap(f);
     return 1;
 }
 
 
+// Setct sets j's counts, making them only if one is not 0.
+static void
+setct(job j, uint32 reserve, uint32 timeout, uint32 release,
+      uint32 bury, uint32 kick)
+{
+    Jobct *ct;
+
+    if (!j->ct && !(reserve | timeout | release | bury | kick)) return;
+    ct = job_ct(j);
+    ct->reserve_ct = reserve;
+    ct->timeout_ct = timeout;
+    ct->release_ct = release;
+    ct->bury_ct = bury;
+    ct->kick_ct = kick;
+}
+
+
+void
+fromwal(job j, Walrec *w)
+{
+    Jobrec *r = &j->r;
+
+    r->id = w->id;
+    r->pri = w->pri;
+    r->delay = w->delay;
+    r->ttr = w->ttr;
+    r->body_size = w->body_size;
+    r->raw_size = w->raw_size;
+    r->created_at = w->created_at;
+    r->deadline_at = w->deadline_at;
+    r->state = w->state;
+    setct(j, w->reserve_ct, w->timeout_ct, w->release_ct,
+          w->bury_ct, w->kick_ct);
+}
+
+
+void
+towal(Walrec *w, job j)
+{
+    Jobrec *r = &j->r;
+
+    memset(w, 0, sizeof *w); // the padding goes to disk too
+    w->id = r->id;
+    w->pri = r->pri;
+    w->delay = r->delay;
+    w->ttr = r->ttr;
+    w->body_size = r->body_size;
+    w->raw_size = r->raw_size;
+    w->created_at = r->created_at;
+    w->deadline_at = r->deadline_at;
+    w->reserve_ct = JOBCT(j, reserve_ct);
+    w->timeout_ct = JOBCT(j, timeout_ct);
+    w->release_ct = JOBCT(j, release_ct);
+    w->bury_ct = JOBCT(j, bury_ct);
+    w->kick_ct = JOBCT(j, kick_ct);
+    w->state = r->state;
+}
+
+
 // Readrec reads a record from f->fd into linked list l.
 // If an error occurs, it sets *err to 1.
 // Readrec returns the number of records read, either 1 or 0.
@@ -137,12 +249,12 @@ readrec(File *f, job l, int *err)
 {
     int r, sz = 0;
     int namelen;
-    Jobrec jr;
+    Walrec jr;
     job j;
     tube t;
     char tubename[MAX_TUBE_NAME_LEN];
 
-    r = read(f->fd, &namelen, sizeof(int));
+    r = fileget(f, &namelen, sizeof(int));
     if (r == -1) {
         twarn("read");
         warnpos(f, 0, "error");
@@ -174,7 +286,7 @@ readrec(File *f, job l, int *err)
     }
     tubename[namelen] = '\0';
 
-    r = readfull(f, &jr, sizeof(Jobrec), err, "job struct");
+    r = readfull(f, &jr, sizeof(Walrec), err, "job struct");
     if (!r) {
         return 0;
     }
@@ -214,7 +326,7 @@ readrec(File *f, job l, int *err)
             j->next = j->prev = j;
             j->r.created_at = jr.created_at;
         }
-        j->r = jr;
+        fromwal(j, &jr);
         job_insert(l, j);
 
         // full record; read the job body
@@ -224,7 +336,19 @@ readrec(File *f, job l, int *err)
                 warnpos(f, -r, "was %d, now %d", j->r.body_size, jr.body_size);
                 goto Error;
             }
-            r = readfull(f, j->body, j->r.body_size, err, "job body");
+            // under -B, leave big bodies on disk (when the file is mapped)
+            j->body_off = f->rpos;
+            if (f->rmap && f->w->bigbody && j->r.body_size >= f->w->bigbody &&
+                f->rlen - f->rpos >= j->r.body_size && job_dropbody(j)) {
+                f->rpos += j->r.body_size;
+                r = j->r.body_size;
+            } else {
+                if (!j->body && !(j->body = malloc(j->r.body_size))) {
+                    twarnx("OOM");
+                    goto Error;
+                }
+                r = readfull(f, j->body, j->r.body_size, err, "job body");
+            }
             if (!r) {
                 goto Error;
             }
@@ -272,7 +396,7 @@ readrec5(File *f, job l, int *err)
     tube t;
     char tubename[MAX_TUBE_NAME_LEN];
 
-    r = read(f->fd, &namelen, sizeof(namelen));
+    r = fileget(f, &namelen, sizeof(namelen));
     if (r == -1) {
         twarn("read");
         warnpos(f, 0, "error");
@@ -345,11 +469,8 @@ readrec5(File *f, job l, int *err)
         j->r.body_size = jr.body_size;
         j->r.created_at = jr.created_at * 1000; // us => ns
         j->r.deadline_at = jr.deadline_at * 1000; // us => ns
-        j->r.reserve_ct = jr.reserve_ct;
-        j->r.timeout_ct = jr.timeout_ct;
-        j->r.release_ct = jr.release_ct;
-        j->r.bury_ct = jr.bury_ct;
-        j->r.kick_ct = jr.kick_ct;
+        setct(j, jr.reserve_ct, jr.timeout_ct, jr.release_ct,
+              jr.bury_ct, jr.kick_ct);
         j->r.state = jr.state;
         job_insert(l, j);
 
@@ -396,12 +517,28 @@ Error:
 }
 
 
+// Fileget copies up to n bytes from the read position of f into c,
+// from the mapping if there is one, otherwise with read(2).
+// It returns the number of bytes copied, or -1 on error.
+static int
+fileget(File *f, void *c, int n)
+{
+    if (!f->rmap) {
+        return read(f->fd, c, n);
+    }
+    n = min(n, f->rlen - f->rpos);
+    memcpy(c, f->rmap + f->rpos, n);
+    f->rpos += n;
+    return n;
+}
+
+
 static int
 readfull(File *f, void *c, int n, int *err, char *desc)
 {
     int r;
 
-    r = read(f->fd, c, n);
+    r = fileget(f, c, n);
     if (r == -1) {
         twarn("read");
         warnpos(f, 0, "error reading %s", desc);
@@ -422,7 +559,7 @@ warnpos(File *f, int adj, char *fmt, ...)
     int off;
     va_list ap;
 
-    off = lseek(f->fd, 0, SEEK_CUR);
+    off = f->rmap ? f->rpos : lseek(f->fd, 0, SEEK_CUR);
     fprintf(stderr, "%s:%u: ", f->path, off+adj);
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -471,25 +608,64 @@ filewopen(File *f)
     fileincref(f);
     f->free = f->w->filesize - n;
     f->resv = 0;
+    f->wpos = n;
+
+    // If this fails, records are written through unbuffered.
+    f->wbuf = malloc(Wbufsize);
+    f->wlen = 0;
+}
+
+
+// Filewflush writes out the records buffered by filewrite.
+// It returns 1 on success, 0 on error.
+int
+filewflush(File *f)
+{
+    int r, n;
+
+    n = f->wlen;
+    if (!n) return 1;
+    f->wlen = 0;
+    r = write(f->fd, f->wbuf, n);
+    if (r != n) {
+        twarn("write");
+        return 0;
+    }
+    return 1;
 }
 
 
+// Filewrite appends buf to the write buffer of f, so that all the
+// records made in one pass of the event loop go out in a single
+// write (see walflush). Records too big for the buffer are written
+// directly, after whatever is buffered ahead of them.
 static int
 filewrite(File *f, job j, void *buf, int len)
 {
     int r;
 
-    r = write(f->fd, buf, len);
-    if (r != len) {
-        twarn("write");
+    if (f->wlen + len > Wbufsize && !filewflush(f)) {
         return 0;
     }
 
-    f->w->resv -= r;
-    f->resv -= r;
-    j->walresv -= r;
-    j->walused += r;
-    f->w->alive += r;
+    if (f->wbuf && len < Wbufsize) {
+        memcpy(f->wbuf + f->wlen, buf, len);
+        f->wlen += len;
+    } else {
+        r = write(f->fd, buf, len);
+        if (r != len) {
+            twarn("write");
+            return 0;
+        }
+    }
+
+    f->wpos += len;
+    f->w->snapbytes += len;
+    f->w->resv -= len;
+    f->resv -= len;
+    j->walresv -= len;
+    j->walused += len;
+    f->w->alive += len;
     return 1;
 }
 
@@ -498,10 +674,12 @@ int
 filewrjobshort(File *f, job j)
 {
     int r, nl;
+    Walrec wr;
 
+    towal(&wr, j);
     nl = 0; // name len 0 indicates short record
     r = filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, &j->r, sizeof j->r);
+        filewrite(f, j, &wr, sizeof wr);
     if (!r) return 0;
 
     if (j->r.state == Invalid) {
@@ -516,22 +694,62 @@ int
 filewrjobfull(File *f, job j)
 {
     int nl;
+    Walrec wr;
 
+    towal(&wr, j);
     fileaddjob(f, j);
     nl = strlen(j->tube->name);
+    j->body_off = f->wpos + sizeof nl + nl + sizeof wr;
     return
         filewrite(f, j, &nl, sizeof nl) &&
         filewrite(f, j, j->tube->name, nl) &&
-        filewrite(f, j, &j->r, sizeof j->r) &&
+        filewrite(f, j, &wr, sizeof wr) &&
         filewrite(f, j, j->body, j->r.body_size);
 }
 
 
+// Filerfd returns a descriptor for reading back f's contents,
+// opening one the first time, or -1 on error.
+int
+filerfd(File *f)
+{
+    if (f->rfd < 0) {
+        f->rfd = open(f->path, O_RDONLY);
+        if (f->rfd < 0) twarn("open %s", f->path);
+    }
+    return f->rfd;
+}
+
+
+// Filepread reads n bytes at offset off in f into buf.
+// It returns 1 on success, 0 on error.
+int
+filepread(File *f, void *buf, int n, int off)
+{
+    int fd, r;
+
+    fd = filerfd(f);
+    if (fd < 0) return 0;
+    r = pread(fd, buf, n, off);
+    if (r != n) {
+        if (r < 0) twarn("pread %s", f->path);
+        else twarnx("%s: short read at %d", f->path, off);
+        return 0;
+    }
+    return 1;
+}
+
+
 void
 filewclose(File *f)
 {
     if (!f) return;
     if (!f->iswopen) return;
+    if (!filewflush(f)) {
+        f->w->use = 0;
+    }
+    free(f->wbuf);
+    f->wbuf = NULL;
     if (f->free) {
         (void)ftruncate(f->fd, f->w->filesize - f->free);
     }
@@ -546,6 +764,7 @@ fileinit(File *f, Wal *w, int n)
 {
     f->w = w;
     f->seq = n;
+    f->rfd = -1;
     f->path = fmtalloc("%s/binlog.%d", w->dir, n);
     return !!f->path;
 }
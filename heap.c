@@ -70,6 +70,30 @@ siftup(Heap *h, int k)
 }
 
 
+// Heapgrow makes room in h for n more items.
+// It returns 1 on success, otherwise 0.
+int
+heapgrow(Heap *h, int n)
+{
+    void **ndata;
+    int ncap;
+
+    if (h->cap - h->len >= n) return 1;
+
+    ncap = (h->len+n) * 2; /* allocate twice what we need */
+    ndata = malloc(sizeof(void*) * ncap);
+    if (!ndata) {
+        return 0;
+    }
+
+    memcpy(ndata, h->data, sizeof(void*)*h->len);
+    free(h->data);
+    h->data = ndata;
+    h->cap = ncap;
+    return 1;
+}
+
+
 // Heapinsert inserts x into heap h according to h->less.
 // It returns 1 on success, otherwise 0.
 int
@@ -77,20 +101,7 @@ heapinsert(Heap *h, void *x)
 {
     int k;
 
-    if (h->len == h->cap) {
-        void **ndata;
-        int ncap = (h->len+1) * 2; /* allocate twice what we need */
-
-        ndata = malloc(sizeof(void*) * ncap);
-        if (!ndata) {
-            return 0;
-        }
-
-        memcpy(ndata, h->data, sizeof(void*)*h->len);
-        free(h->data);
-        h->data = ndata;
-        h->cap = ncap;
-    }
+    if (!heapgrow(h, 1)) return 0;
 
     k = h->len;
     h->len++;
@@ -117,3 +128,167 @@ heapremove(Heap *h, int k)
     h->rec(x, -1);
     return x;
 }
+
+
+/* Jobheaps are 4-ary: a node's children are adjacent in memory, and the
+ * tree is half as deep as a binary one. */
+enum { Arity = 4 };
+
+
+static int
+jobless(Jobent *a, Jobent *b)
+{
+    if (a->key != b->key) return a->key < b->key;
+    return a->id < b->id;
+}
+
+
+static void
+jobset(Jobheap *h, int k, Jobent e)
+{
+    h->data[k] = e;
+    e.j->heap_index = k;
+}
+
+
+static void
+jobsiftdown(Jobheap *h, int k)
+{
+    Jobent e = h->data[k];
+
+    while (k > 0) {
+        int p = (k-1) / Arity; /* parent */
+
+        if (!jobless(&e, &h->data[p])) break;
+        jobset(h, k, h->data[p]);
+        k = p;
+    }
+    jobset(h, k, e);
+}
+
+
+static void
+jobsiftup(Jobheap *h, int k)
+{
+    Jobent e = h->data[k];
+
+    for (;;) {
+        int c, s, end;
+
+        c = k*Arity + 1; /* first child */
+        if (c >= h->len) break;
+        end = min(c + Arity, h->len);
+
+        /* find the smallest child */
+        for (s = c++; c < end; c++) {
+            if (jobless(&h->data[c], &h->data[s])) s = c;
+        }
+        if (!jobless(&h->data[s], &e)) break;
+
+        jobset(h, k, h->data[s]);
+        k = s;
+    }
+    jobset(h, k, e);
+}
+
+
+// Jobheapgrow makes room in h for n more jobs.
+// It returns 1 on success, otherwise 0.
+int
+jobheapgrow(Jobheap *h, int n)
+{
+    Jobent *ndata;
+    int ncap;
+
+    if (h->cap - h->len >= n) return 1;
+
+    ncap = (h->len+n) * 2; /* allocate twice what we need */
+    ndata = realloc(h->data, sizeof(Jobent) * ncap);
+    if (!ndata) {
+        return 0;
+    }
+
+    h->data = ndata;
+    h->cap = ncap;
+    return 1;
+}
+
+
+// Jobheapinsert inserts j into h, ordered by key and then by j's id.
+// It returns 1 on success, otherwise 0.
+int
+jobheapinsert(Jobheap *h, job j, int64 key)
+{
+    int k;
+
+    if (!jobheapgrow(h, 1)) return 0;
+
+    k = h->len;
+    h->len++;
+    jobset(h, k, (Jobent){key, j->r.id, j});
+    jobsiftdown(h, k);
+    return 1;
+}
+
+
+// Jobheappush adds j at the end of h without ordering it, for adding
+// many jobs at once. The caller must have made room with jobheapgrow,
+// and must call jobheapfix before using h as a heap again.
+void
+jobheappush(Jobheap *h, job j, int64 key)
+{
+    jobset(h, h->len++, (Jobent){key, j->r.id, j});
+}
+
+
+// Jobheapfix restores the order of h after jobheappush has added
+// the jobs from position k on. If there are enough of them, it
+// rebuilds the whole heap, which takes linear time, rather than
+// sifting each one into place.
+void
+jobheapfix(Jobheap *h, int k)
+{
+    int n = h->len - k, depth, i;
+
+    if (k >= h->len) return; /* nothing was added */
+    for (depth = 1, i = h->len; i > Arity; i /= Arity) depth++;
+    if ((int64)n * depth < h->len) {
+        for (; k < h->len; k++) jobsiftdown(h, k);
+        return;
+    }
+
+    for (k = (h->len - 2) / Arity; k >= 0; k--) {
+        jobsiftup(h, k);
+    }
+}
+
+
+// Jobheapupdate gives the job at position k in h a new key.
+void
+jobheapupdate(Jobheap *h, int k, int64 key)
+{
+    h->data[k].key = key;
+    jobsiftdown(h, k);
+    jobsiftup(h, k);
+}
+
+
+job
+jobheapremove(Jobheap *h, int k)
+{
+    job j;
+
+    if (k >= h->len) {
+        return NULL;
+    }
+
+    j = h->data[k].j;
+    h->len--;
+    if (k < h->len) {
+        jobset(h, k, h->data[h->len]);
+        jobsiftdown(h, k);
+        jobsiftup(h, k);
+    }
+    j->heap_index = -1;
+    return j;
+}
@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "dat.h"
+
+/* A Hist counts durations in log-linear buckets, like an HDR histogram.
+ * Values below Histsub get a bucket each. Above that, each power of two
+ * is split into Histsub buckets, so a bucket is never wider than 1/Histsub
+ * of the values in it. Values of 2^Histbits ns (about 18 minutes) or more
+ * all go in the last bucket. */
+
+static int
+bucket(int64 v)
+{
+    int e;
+
+    if (v < Histsub) return v < 0 ? 0 : v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= Histbits) return Histn - 1;
+    return (e - Histsubbits + 1) * Histsub + (v >> (e - Histsubbits)) - Histsub;
+}
+
+
+/* the largest value that goes in bucket i */
+static int64
+bucketmax(int i)
+{
+    int k = i / Histsub, m = i % Histsub;
+
+    if (k == 0) return i;
+    return ((int64)(Histsub + m + 1) << (k - 1)) - 1;
+}
+
+
+void
+histadd(Hist *h, int64 v)
+{
+    h->ct[bucket(v)]++;
+    h->n++;
+    if (v > h->max) h->max = v;
+}
+
+
+/* Histpct returns (an upper bound on) the q-th quantile of h,
+ * for q between 0 and 1, or 0 if h is empty. */
+int64
+histpct(Hist *h, double q)
+{
+    int i;
+    uint64 seen = 0, rank;
+
+    if (!h->n) return 0;
+    rank = q * h->n;
+    if (rank >= h->n) rank = h->n - 1;
+    for (i = 0; i < Histn; i++) {
+        seen += h->ct[i];
+        if (seen > rank) break;
+    }
+    if (i < Histn - 1) return min(bucketmax(i), h->max);
+    return h->max; // the last bucket has no upper bound
+    return h->max;
+}
+
+
+/* Fmthist appends a summary of h, in microseconds, to the n bytes
+ * already in buf, under keys starting with name. It returns the new
+ * length, which may be more than size, as with snprintf. */
+int
+fmthist(char *buf, size_t size, int n, const char *name, Hist *h)
+{
+    return n + snprintf(buf ? buf + n : NULL, size > n ? size - n : 0,
+            "%s-count: %" PRIu64 "\n"
+            "%s-p50: %" PRId64 "\n"
+            "%s-p90: %" PRId64 "\n"
+            "%s-p99: %" PRId64 "\n"
+            "%s-p999: %" PRId64 "\n"
+            "%s-max: %" PRId64 "\n",
+            name, h ? h->n : 0,
+            name, h ? histpct(h, 0.5) / 1000 : 0,
+            name, h ? histpct(h, 0.9) / 1000 : 0,
+            name, h ? histpct(h, 0.99) / 1000 : 0,
+            name, h ? histpct(h, 0.999) / 1000 : 0,
+            name, h ? h->max / 1000 : 0);
+}
@@ -1,92 +1,283 @@
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef ZLIB
+#include <zlib.h>
+#endif
 #include "dat.h"
 
+/* compress bodies at least this big (see job_zip); 0 for never */
+size_t job_zip_min = 0;
+
 static uint64 next_id = 1;
 
-static int cur_prime = 0;
+/* Jobs are indexed by id in an open-addressing table with linear probing,
+ * whose size is a power of two. When it has to grow or shrink, the old table
+ * is kept around and its jobs are moved to the new one a few slots at a time,
+ * on each later lookup, insert, and delete, so no single operation has to
+ * move them all. Until then, lookups try the new table and then the old one.
+ * Deleting from the old table, or moving a job out of it, leaves a tombstone
+ * so the probe sequences of the jobs still there stay intact. */
+enum
+{
+    Jobtabmin = 1 << 14, /* slots */
+    Migratestep = 4      /* old slots to move per operation */
+};
 
-static job all_jobs_init[12289] = {0};
+static job all_jobs_init[Jobtabmin];
 static job *all_jobs = all_jobs_init;
-static size_t all_jobs_cap = 12289; /* == primes[0] */
-static size_t all_jobs_used = 0;
+static size_t all_jobs_cap = Jobtabmin;
+static size_t all_jobs_used = 0; /* in both tables */
+static size_t cur_jobs_used = 0; /* in all_jobs */
+
+static job *old_jobs; /* the table being migrated from, or NULL */
+static size_t old_jobs_cap;
+static size_t old_jobs_pos; /* slots below this have been migrated */
+
+static char tomb;
+#define Tomb ((job)&tomb)
 
 static int hash_table_was_oom = 0;
 
-static void rehash();
+enum
+{
+    Poolslab = 64 << 10, /* bytes per slab */
+    Poolalign = 16
+};
+
+/* Job allocations whose body fits in one of these size classes come from
+ * a per-class free list, refilled a slab at a time. Slabs are never given
+ * back to the system; freed jobs go back on their class's free list. */
+struct pool {
+    int    body_size; /* largest body that fits */
+    size_t size;      /* bytes per object */
+    void   *free;     /* free list, linked through the first word */
+    size_t used;
+    size_t nfree;
+    size_t nslab;
+};
+
+static struct pool pools[] = {
+    {32},
+    {64},
+    {128},
+    {256},
+};
+
+#define NPOOL (sizeof(pools) / sizeof(pools[0]))
+
+static int
+pool_class(int body_size)
+{
+    int i;
+
+    for (i = 0; i < NPOOL; i++) {
+        if (body_size <= pools[i].body_size) return i;
+    }
+    return -1;
+}
 
+// Returns 1 on success, 0 on failure (out of memory).
 static int
-_get_job_hash_index(uint64 job_id)
+pool_grow(struct pool *p)
 {
-    return job_id % all_jobs_cap;
+    char *slab;
+    size_t i, n;
+
+    if (!p->size) {
+        p->size = sizeof(struct job) + p->body_size;
+        p->size = (p->size + Poolalign - 1) & ~(size_t)(Poolalign - 1);
+    }
+
+    slab = malloc(Poolslab);
+    if (!slab) return 0;
+
+    n = Poolslab / p->size;
+    for (i = 0; i < n; i++) {
+        *(void **)(slab + i*p->size) = p->free;
+        p->free = slab + i*p->size;
+    }
+    p->nfree += n;
+    p->nslab++;
+    return 1;
+}
+
+static job
+job_alloc(int body_size)
+{
+    job j;
+    int cls;
+    struct pool *p;
+
+    cls = pool_class(body_size);
+    if (cls < 0) {
+        /* big bodies are separate, so they can be dropped; see job_dropbody */
+        j = malloc(sizeof(struct job));
+        if (!j) return NULL;
+        j->body = malloc(body_size);
+        if (!j->body) {
+            free(j);
+            return NULL;
+        }
+        j->pool = -1;
+        return j;
+    }
+
+    p = &pools[cls];
+    if (!p->free && !pool_grow(p)) return NULL;
+    j = p->free;
+    p->free = *(void **)j;
+    p->nfree--;
+    p->used++;
+    j->pool = cls;
+    j->body = (char *)(j + 1);
+    return j;
 }
 
 static void
-store_job(job j)
+job_release(job j)
 {
-    int index = 0;
+    struct pool *p;
 
-    index = _get_job_hash_index(j->r.id);
+    if (!j) return;
+    free(j->ct);
+    if (j->pool < 0) {
+        free(j->body);
+        free(j);
+        return;
+    }
 
-    j->ht_next = all_jobs[index];
-    all_jobs[index] = j;
-    all_jobs_used++;
+    p = &pools[j->pool];
+    *(void **)j = p->free;
+    p->free = j;
+    p->nfree++;
+    p->used--;
+}
+
+static size_t
+hash_slot(uint64 id, size_t cap)
+{
+    uint64 h = id * 0x9E3779B97F4A7C15ULL;
 
-    /* accept a load factor of 4 */
-    if (all_jobs_used > (all_jobs_cap << 2)) rehash(1);
+    return (h ^ (h >> 32)) & (cap - 1);
 }
 
+/* Return the slot holding id in tab, or NULL. */
+static job *
+table_find(job *tab, size_t cap, uint64 id)
+{
+    size_t i;
+    job j;
+
+    for (i = hash_slot(id, cap); (j = tab[i]); i = (i + 1) & (cap - 1)) {
+        if (j != Tomb && j->r.id == id) return &tab[i];
+    }
+    return NULL;
+}
+
+/* Put j in the first free slot of its probe sequence in all_jobs. */
 static void
-rehash(int is_upscaling)
+table_put(job j)
 {
-    job *old = all_jobs;
-    size_t old_cap = all_jobs_cap, old_used = all_jobs_used, i;
-    int old_prime = cur_prime;
-    int d = is_upscaling ? 1 : -1;
+    size_t i, mask = all_jobs_cap - 1;
+
+    for (i = hash_slot(j->r.id, all_jobs_cap); all_jobs[i]; i = (i + 1) & mask);
+    all_jobs[i] = j;
+    cur_jobs_used++;
+}
 
-    if (cur_prime + d >= NUM_PRIMES) return;
-    if (cur_prime + d < 0) return;
-    if (is_upscaling && hash_table_was_oom) return;
+/* Empty slot i of all_jobs, shifting later members of the probe sequence
+ * back over the hole. */
+static void
+table_remove(size_t i)
+{
+    size_t j, k, mask = all_jobs_cap - 1;
+
+    all_jobs[i] = NULL;
+    cur_jobs_used--;
+    for (j = (i + 1) & mask; all_jobs[j]; j = (j + 1) & mask) {
+        k = hash_slot(all_jobs[j]->r.id, all_jobs_cap);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        all_jobs[i] = all_jobs[j];
+        all_jobs[j] = NULL;
+        i = j;
+    }
+}
 
-    cur_prime += d;
+/* Move the jobs in the next n slots of old_jobs into all_jobs. */
+static void
+migrate(size_t n)
+{
+    job j;
 
-    all_jobs_cap = primes[cur_prime];
-    all_jobs = calloc(all_jobs_cap, sizeof(job));
-    if (!all_jobs) {
-        twarnx("Failed to allocate %zu new hash buckets", all_jobs_cap);
+    if (!old_jobs) return;
+    for (; n && old_jobs_pos < old_jobs_cap; n--, old_jobs_pos++) {
+        j = old_jobs[old_jobs_pos];
+        if (j && j != Tomb) {
+            old_jobs[old_jobs_pos] = Tomb;
+            table_put(j);
+        }
+    }
+    if (old_jobs_pos == old_jobs_cap) {
+        if (old_jobs != all_jobs_init) free(old_jobs);
+        old_jobs = NULL;
+    }
+}
+
+/* Start migrating all jobs to a new table of cap slots. */
+static void
+resize(size_t cap)
+{
+    job *tab;
+
+    /* finish the migration in progress first; this is rare */
+    migrate(old_jobs_cap);
+
+    tab = calloc(cap, sizeof(job));
+    if (!tab) {
+        if (!hash_table_was_oom) {
+            twarnx("Failed to allocate %zu new hash buckets", cap);
+        }
         hash_table_was_oom = 1;
-        cur_prime = old_prime;
-        all_jobs = old;
-        all_jobs_cap = old_cap;
-        all_jobs_used = old_used;
         return;
     }
-    all_jobs_used = 0;
     hash_table_was_oom = 0;
 
-    for (i = 0; i < old_cap; i++) {
-        while (old[i]) {
-            job j = old[i];
-            old[i] = j->ht_next;
-            j->ht_next = NULL;
-            store_job(j);
-        }
-    }
-    if (old != all_jobs_init) {
-        free(old);
-    }
+    old_jobs = all_jobs;
+    old_jobs_cap = all_jobs_cap;
+    old_jobs_pos = 0;
+    all_jobs = tab;
+    all_jobs_cap = cap;
+    cur_jobs_used = 0;
+}
+
+/* Returns 1 on success, 0 if the table is out of room. */
+static int
+store_job(job j)
+{
+    migrate(Migratestep);
+
+    /* keep at least an eighth of the slots free, even if we can't grow */
+    if (cur_jobs_used + 1 > all_jobs_cap - all_jobs_cap / 8) return 0;
+
+    table_put(j);
+    all_jobs_used++;
+
+    if (all_jobs_used > all_jobs_cap / 2) resize(all_jobs_cap * 2);
+    return 1;
 }
 
 job
 job_find(uint64 job_id)
 {
-    job jh = NULL;
-    int index = _get_job_hash_index(job_id);
-
-    for (jh = all_jobs[index]; jh && jh->r.id != job_id; jh = jh->ht_next);
+    job *slot;
 
-    return jh;
+    migrate(Migratestep);
+    slot = table_find(all_jobs, all_jobs_cap, job_id);
+    if (!slot && old_jobs) slot = table_find(old_jobs, old_jobs_cap, job_id);
+    return slot ? *slot : NULL;
 }
 
 job
@@ -94,10 +285,10 @@ allocate_job(int body_size)
 {
     job j;
 
-    j = malloc(sizeof(struct job) + body_size);
+    j = job_alloc(body_size);
     if (!j) return twarnx("OOM"), (job) 0;
 
-    memset(j, 0, sizeof(struct job));
+    memset(j, 0, offsetof(struct job, pool));
     j->r.created_at = nanoseconds();
     j->r.body_size = body_size;
     j->next = j->prev = j; /* not in a linked list */
@@ -123,7 +314,10 @@ make_job_with_id(uint pri, int64 delay, int64 ttr,
     j->r.delay = delay;
     j->r.ttr = ttr;
 
-    store_job(j);
+    if (!store_job(j)) {
+        job_release(j);
+        return twarnx("OOM"), (job) 0;
+    }
 
     TUBE_ASSIGN(j->tube, tube);
 
@@ -135,15 +329,25 @@ job_hash_free(job j)
 {
     job *slot;
 
-    slot = &all_jobs[_get_job_hash_index(j->r.id)];
-    while (*slot && *slot != j) slot = &(*slot)->ht_next;
-    if (*slot) {
-        *slot = (*slot)->ht_next;
+    migrate(Migratestep);
+    slot = table_find(all_jobs, all_jobs_cap, j->r.id);
+    if (slot && *slot == j) {
+        table_remove(slot - all_jobs);
+        --all_jobs_used;
+    } else if (old_jobs) {
+        slot = table_find(old_jobs, old_jobs_cap, j->r.id);
+        if (!slot || *slot != j) return;
+        *slot = Tomb;
         --all_jobs_used;
+    } else {
+        return;
     }
 
-    // Downscale when the hashmap is too sparse
-    if (all_jobs_used < (all_jobs_cap >> 4)) rehash(0);
+    // Downscale when the table is too sparse
+    if (!old_jobs && all_jobs_cap > Jobtabmin &&
+        all_jobs_used < all_jobs_cap / 16) {
+        resize(all_jobs_cap / 2);
+    }
 }
 
 void
@@ -154,7 +358,7 @@ job_free(job j)
         if (j->r.state != Copy) job_hash_free(j);
     }
 
-    free(j);
+    job_release(j);
 }
 
 void
@@ -188,13 +392,20 @@ job_copy(job j)
 
     if (!j) return NULL;
 
-    n = malloc(sizeof(struct job) + j->r.body_size);
+    n = job_alloc(job_bodysize(j));
     if (!n) return twarnx("OOM"), (job) 0;
 
-    memcpy(n, j, sizeof(struct job) + j->r.body_size);
+    memcpy(n, j, offsetof(struct job, pool));
+    if (!job_readbody(j, n->body)) {
+        job_release(n);
+        return NULL;
+    }
+    n->r.body_size = job_bodysize(j); /* the copy is not compressed */
+    n->r.raw_size = 0;
     n->next = n->prev = n; /* not in a linked list */
 
     n->file = NULL; /* copies do not have refcnt on the wal */
+    n->ct = NULL; /* nor their own counts */
 
     n->tube = 0; /* Don't use memcpy for the tube, which we must refcount. */
     TUBE_ASSIGN(n->tube, j->tube);
@@ -205,6 +416,141 @@ job_copy(job j)
     return n;
 }
 
+/* J's counts, made on first use. If there is no memory for them, this
+ * gives a scratch copy instead, and the count is lost. */
+Jobct *
+job_ct(job j)
+{
+    static Jobct scratch;
+
+    if (!j->ct) j->ct = calloc(1, sizeof(Jobct));
+    if (!j->ct) {
+        twarnx("OOM");
+        memset(&scratch, 0, sizeof scratch);
+        return &scratch;
+    }
+    return j->ct;
+}
+
+/* The size of j's body as clients see it. */
+int
+job_bodysize(job j)
+{
+    return j->r.raw_size ? j->r.raw_size : j->r.body_size;
+}
+
+/* Copy j's body as stored, maybe compressed, into buf,
+ * from memory or else from the wal.
+ * Returns 1 on success, 0 on failure. */
+static int
+readstored(job j, char *buf)
+{
+    if (j->body) {
+        memcpy(buf, j->body, j->r.body_size);
+        return 1;
+    }
+    if (!j->file) return twarnx("job %"PRIu64" has no body", j->r.id), 0;
+    return filepread(j->file, buf, j->r.body_size, j->body_off);
+}
+
+/* Copy j's body into buf, which must hold job_bodysize(j) bytes,
+ * uncompressing it if need be.
+ * Returns 1 on success, 0 on failure. */
+int
+job_readbody(job j, char *buf)
+{
+#ifdef ZLIB
+    char *z;
+    uLongf n = j->r.raw_size;
+    int r;
+
+    if (!j->r.raw_size) return readstored(j, buf);
+    z = j->body;
+    if (!z) {
+        z = malloc(j->r.body_size);
+        if (!z) return twarnx("OOM"), 0;
+        if (!readstored(j, z)) {
+            free(z);
+            return 0;
+        }
+    }
+    r = uncompress((Bytef *)buf, &n, (Bytef *)z, j->r.body_size);
+    if (z != j->body) free(z);
+    if (r != Z_OK || n != j->r.raw_size) {
+        return twarnx("job %"PRIu64": bad compressed body", j->r.id), 0;
+    }
+    return 1;
+#else
+    if (j->r.raw_size) {
+        return twarnx("job %"PRIu64": compressed, but no zlib", j->r.id), 0;
+    }
+    return readstored(j, buf);
+#endif
+}
+
+/* Bring j's body back into memory if it lives only in the wal.
+ * Returns 1 on success, 0 on failure. */
+int
+job_loadbody(job j)
+{
+    char *b;
+
+    if (j->body) return 1;
+    b = malloc(j->r.body_size);
+    if (!b) return twarnx("OOM"), 0;
+    if (!readstored(j, b)) {
+        free(b);
+        return 0;
+    }
+    j->body = b;
+    return 1;
+}
+
+/* Free j's body, which the caller has made sure is on disk at j->file
+ * and j->body_off. Bodies small enough to share an allocation with the
+ * job are kept. Returns 1 if j no longer has a body in memory. */
+int
+job_dropbody(job j)
+{
+    if (j->pool >= 0) return 0;
+    free(j->body);
+    j->body = NULL;
+    return 1;
+}
+
+/* Compress j's body in memory, if it is at least job_zip_min bytes
+ * and compression saves enough to be worth it. Do this before j goes
+ * in the wal; from then on the wal holds the compressed body too.
+ * Bodies small enough to share an allocation with the job are kept
+ * as they are, since compressing them would free nothing. */
+void
+job_zip(job j)
+{
+#ifdef ZLIB
+    char *z, *p;
+    uLongf n;
+
+    if (!job_zip_min || j->r.body_size < job_zip_min) return;
+    if (j->r.raw_size || j->pool >= 0 || !j->body) return;
+
+    n = compressBound(j->r.body_size);
+    z = malloc(n);
+    if (!z) return; /* keep it as it is */
+    if (compress2((Bytef *)z, &n, (Bytef *)j->body, j->r.body_size,
+                  Z_BEST_SPEED) != Z_OK ||
+        n > j->r.body_size - j->r.body_size/8) {
+        free(z);
+        return;
+    }
+    p = realloc(z, n);
+    if (p) z = p;
+    free(j->body);
+    j->body = z;
+    j->r.raw_size = j->r.body_size;
+    j->r.body_size = n;
+#endif
+}
+
 const char *
 job_state(job j)
 {
@@ -252,6 +598,29 @@ total_jobs()
     return next_id - 1;
 }
 
+/* Set aside n consecutive job ids and return the first. */
+uint64
+job_reserve_ids(int n)
+{
+    uint64 id = next_id;
+
+    next_id += n;
+    return id;
+}
+
+void
+job_pool_stats(size_t *bytes, size_t *used, size_t *nfree)
+{
+    int i;
+
+    *bytes = *used = *nfree = 0;
+    for (i = 0; i < NPOOL; i++) {
+        *bytes += pools[i].nslab * Poolslab;
+        *used += pools[i].used;
+        *nfree += pools[i].nfree;
+    }
+}
+
 /* for unit tests */
 size_t
 get_all_jobs_used()
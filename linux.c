@@ -1,17 +1,153 @@
 #define _XOPEN_SOURCE 600
+#define _GNU_SOURCE /* for accept4 */
+#ifdef URING
+#define _DEFAULT_SOURCE /* for syscall */
+#endif
 #include <stdint.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include "dat.h"
 
+#ifdef URING
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP 0x2000
 #endif
 
+enum
+{
+    Nevent = 128 /* max events taken from one epoll_wait */
+};
+
 static int epfd;
 
+/* Events from the last epoll_wait not yet returned by socknext.
+ * An entry's data.ptr is NULL if its socket was removed meanwhile. */
+static struct epoll_event evs[Nevent];
+static int nev, iev;
+
+
+#ifdef URING
+
+/* With URING defined (make URING=1), fsyncs that needn't finish before
+ * a reply (-f with a nonzero period) go to an io_uring, if the kernel
+ * lets us set one up, and run in the background. Sockets stay with
+ * epoll. */
+
+enum
+{
+    Nring = 8 /* submission queue entries */
+};
+
+static struct {
+    int      fd; /* -1 if there is no ring */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned nsq, tosubmit;
+} ring = {.fd = -1};
+
+
+static void
+uringsubmit(void)
+{
+    int r;
+
+    while (ring.tosubmit) {
+        r = syscall(__NR_io_uring_enter, ring.fd, ring.tosubmit, 0, 0, NULL, 0);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            twarn("io_uring_enter");
+            exit(1);
+        }
+        ring.tosubmit -= r;
+    }
+}
+
+
+/* Returns a zeroed submission queue entry, to be sent
+ * with the next call to uringsubmit. */
+static struct io_uring_sqe *
+uringsqe(void)
+{
+    unsigned tail, i;
+    struct io_uring_sqe *sqe;
+
+    tail = *ring.sqtail;
+    if (tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) == ring.nsq) {
+        uringsubmit();
+    }
+    i = tail & *ring.sqmask;
+    sqe = &ring.sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    ring.sqarray[i] = i;
+    __atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+    ring.tosubmit++;
+    return sqe;
+}
+
+
+static int
+uringinit(void)
+{
+    struct io_uring_params p = {};
+    char *sq, *cq;
+    size_t sqlen, cqlen;
+    int fd;
+
+    fd = syscall(__NR_io_uring_setup, Nring, &p);
+    if (fd == -1) return -1;
+
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqlen > sqlen) sqlen = cqlen;
+        cqlen = sqlen;
+    }
+    sq = mmap(0, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED,
+              fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(0, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED,
+                  fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    ring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ|PROT_WRITE, MAP_SHARED,
+                     fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) goto fail;
+
+    ring.sqhead = (unsigned *)(sq + p.sq_off.head);
+    ring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sqarray = (unsigned *)(sq + p.sq_off.array);
+    ring.cqhead = (unsigned *)(cq + p.cq_off.head);
+    ring.cqtail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.nsq = p.sq_entries;
+    ring.fd = fd;
+    return 0;
+
+fail:
+    close(fd); /* the kernel drops the mappings with the ring */
+    return -1;
+}
+
+#endif
+
 
 /* Allocate disk space.
  * Expects fd's offset to be 0; may also reset fd's offset to 0.
@@ -23,9 +159,77 @@ rawfalloc(int fd, int len)
 }
 
 
+/* Send n bytes at offset off in file in to socket out.
+ * Returns the number of bytes sent, or -1 on error. */
+int
+rawsendfile(int out, int in, int off, int n)
+{
+    off_t o = off;
+
+    return sendfile(out, in, &o, n);
+}
+
+
+/* Start an fsync of fd that runs in the background, if we can.
+ * Returns 1 if so, or 0 if the caller should call fsync itself.
+ * Only one runs at a time; see rawsyncdone. */
+int
+rawsyncstart(int fd)
+{
+#ifdef URING
+    struct io_uring_sqe *sqe;
+
+    if (ring.fd == -1) return 0;
+    sqe = uringsqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    uringsubmit(); /* before fd can be closed */
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/* Returns 1 if the fsync last started by rawsyncstart has finished,
+ * 0 if it is still running, or -1 if it failed. */
+int
+rawsyncdone(void)
+{
+#ifdef URING
+    unsigned head;
+    int res;
+
+    if (ring.fd == -1) return 1;
+    head = *ring.cqhead;
+    if (head == __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) return 0;
+    res = ring.cqes[head & *ring.cqmask].res;
+    __atomic_store_n(ring.cqhead, head + 1, __ATOMIC_RELEASE);
+    if (res < 0) {
+        errno = -res;
+        twarn("fsync");
+        return -1;
+    }
+#endif
+    return 1;
+}
+
+
+/* Accept a connection on listening socket fd, already nonblocking.
+ * Returns the new fd, or -1 on error. */
+int
+rawaccept(int fd)
+{
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+}
+
+
 int
 sockinit(void)
 {
+#ifdef URING
+    if (uringinit() == -1) twarn("io_uring_setup, syncing in the foreground");
+#endif
     epfd = epoll_create(1);
     if (epfd == -1) {
         twarn("epoll_create");
@@ -38,7 +242,7 @@ sockinit(void)
 int
 sockwant(Socket *s, int rw)
 {
-    int op;
+    int i, op;
     struct epoll_event ev = {};
 
     if (!s->added && !rw) {
@@ -48,6 +252,9 @@ sockwant(Socket *s, int rw)
         op = EPOLL_CTL_ADD;
     } else if (!rw) {
         op = EPOLL_CTL_DEL;
+        for (i = iev; i < nev; i++) {
+            if (evs[i].data.ptr == s) evs[i].data.ptr = NULL;
+        }
     } else {
         op = EPOLL_CTL_MOD;
     }
@@ -67,27 +274,44 @@ sockwant(Socket *s, int rw)
 }
 
 
+// Socknext returns the next event from the current batch. If the batch
+// is used up, it first waits up to timeout for a new one.
 int
 socknext(Socket **s, int64 timeout)
 {
     int r;
-    struct epoll_event ev;
+    struct epoll_event *ev;
 
-    r = epoll_wait(epfd, &ev, 1, (int)(timeout/1000000));
-    if (r == -1 && errno != EINTR) {
-        twarn("epoll_wait");
-        exit(1);
+    if (iev == nev) {
+        iev = nev = 0;
+        r = epoll_wait(epfd, evs, Nevent, (int)(timeout/1000000));
+        if (r == -1 && errno != EINTR) {
+            twarn("epoll_wait");
+            exit(1);
+        }
+        if (r > 0) nev = r;
     }
 
-    if (r > 0) {
-        *s = ev.data.ptr;
-        if (ev.events & (EPOLLHUP|EPOLLRDHUP)) {
+    while (iev < nev) {
+        ev = &evs[iev++];
+        if (!ev->data.ptr) continue;
+
+        *s = ev->data.ptr;
+        if (ev->events & (EPOLLHUP|EPOLLRDHUP)) {
             return 'h';
-        } else if (ev.events & EPOLLIN) {
+        } else if (ev->events & EPOLLIN) {
             return 'r';
-        } else if (ev.events & EPOLLOUT) {
+        } else if (ev->events & EPOLLOUT) {
             return 'w';
         }
     }
     return 0;
 }
+
+
+// Sockpending returns 1 if the current batch has events left.
+int
+sockpending(void)
+{
+    return iev < nev;
+}
@@ -0,0 +1,588 @@
+// Loadgen drives a beanstalkd server with many connections at once
+// and reports throughput and latency. See "make bench-load" and the
+// usage message below.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "dat.h"
+
+typedef struct Lconn Lconn;
+
+struct Lconn {
+    int    fd;
+    int    worker;
+    int    tube;
+    int    outstanding; // puts, or reserves, not yet answered
+    int64  *sent;       // ring of send times of outstanding puts
+    int    shead;
+    char   *rbuf;
+    int    rlen;
+    char   *wbuf;
+    int    wlen;
+    int    inbatch;     // jobs still to come in a RESERVED-BATCH reply
+    uint64 *ids;        // jobs received in this batch, to delete
+    int    nids;
+};
+
+enum { Rbufsize = 1<<20 };
+
+// Binary protocol op codes, statuses and header size; see doc/protocol.txt.
+enum
+{
+    Bput = 1, Breserve = 3, Bdelete = 4, Breservetimeout = 20,
+    Binserted = 1, Breserved = 3, Bdeleted = 5, Btimedout = 14,
+    Bhdrsize = 32,
+};
+
+static int nproducer = 4, nworker = 4, depth = 16, ntube = 1, bodysize = 100;
+static int64 njob = 200000;
+static int batch, binproto, binlog, fsyncms = -1;
+static char *srvpath = "./beanstalkd", *addr;
+
+static int64 nput, ninserted, nconsumed;
+static Hist puthist, e2ehist;
+static char *body;
+static Lconn *conns;
+static int nconn;
+
+
+static void
+usage()
+{
+    fprintf(stderr, "Use: loadgen [OPTIONS]\n"
+            "\n"
+            "Options:\n"
+            " -p N     producer connections (default 4)\n"
+            " -w N     worker connections (default 4)\n"
+            " -d N     commands each connection keeps in flight; with -B,\n"
+            "            jobs each worker asks for at once (default 16)\n"
+            " -t N     spread jobs over N tubes (default 1)\n"
+            " -s BYTES job body size, at least 20 (default 100)\n"
+            " -n N     number of jobs (default 200000)\n"
+            " -B       use reserve-batch and delete-batch in workers\n"
+            " -P       put, reserve and delete in the binary protocol;\n"
+            "            not with -B\n"
+            " -b       give the server a binlog, in a temporary directory\n"
+            " -f MS    also pass -f MS to the server; implies -b\n"
+            " -x PATH  server to start (default ./beanstalkd)\n"
+            " -a HOST:PORT  use a running server instead of starting one\n");
+    exit(2);
+}
+
+
+static void
+die(char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+
+static int64
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+
+static int
+dial(char *host, char *port)
+{
+    int fd, one = 1;
+    struct addrinfo hints = {0}, *ai;
+
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai)) return -1;
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd == -1) die("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        close(fd);
+        freeaddrinfo(ai);
+        return -1;
+    }
+    freeaddrinfo(ai);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+
+// Picks a free port on the loopback interface.
+static int
+freeport()
+{
+    int fd;
+    struct sockaddr_in sa = {0};
+    socklen_t len = sizeof sa;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) die("socket");
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1) die("bind");
+    if (getsockname(fd, (struct sockaddr *)&sa, &len) == -1) die("getsockname");
+    close(fd);
+    return ntohs(sa.sin_port);
+}
+
+
+static pid_t
+startserver(char *port, char *dir)
+{
+    pid_t pid;
+    char *argv[16], ms[32];
+    int argc = 0;
+
+    argv[argc++] = srvpath;
+    argv[argc++] = "-l";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = "-z";
+    argv[argc++] = "1000000";
+    if (dir) {
+        argv[argc++] = "-b";
+        argv[argc++] = dir;
+    }
+    if (fsyncms >= 0) {
+        snprintf(ms, sizeof ms, "%d", fsyncms);
+        argv[argc++] = "-f";
+        argv[argc++] = ms;
+    }
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        execv(srvpath, argv);
+        perror(srvpath);
+        _exit(127);
+    }
+    return pid;
+}
+
+
+static void
+rmdir_all(char *dir)
+{
+    DIR *d;
+    struct dirent *e;
+    char path[1024];
+
+    d = opendir(dir);
+    if (!d) return;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+
+static void
+queue(Lconn *c, char *s, int n)
+{
+    memcpy(c->wbuf + c->wlen, s, n);
+    c->wlen += n;
+}
+
+
+static void
+queuef(Lconn *c, char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    c->wlen += vsprintf(c->wbuf + c->wlen, fmt, ap);
+    va_end(ap);
+}
+
+
+static void
+flush(Lconn *c)
+{
+    int n;
+
+    if (!c->wlen) return;
+    n = write(c->fd, c->wbuf, c->wlen);
+    if (n == -1) {
+        if (errno == EAGAIN) return;
+        die("write");
+    }
+    memmove(c->wbuf, c->wbuf + n, c->wlen - n);
+    c->wlen -= n;
+}
+
+
+static void
+putle(char *p, uint64 v, int n)
+{
+    for (; n; n--, v >>= 8) *p++ = v;
+}
+
+
+static uint64
+getle(char *p, int n)
+{
+    uint64 v = 0;
+
+    while (n--) v = v << 8 | (byte)p[n];
+    return v;
+}
+
+
+// Queueframe queues a binary header for a command with n bytes of data.
+static void
+queueframe(Lconn *c, int op, uint64 id, uint delay, uint ttr, int n)
+{
+    char *h = c->wbuf + c->wlen;
+
+    memset(h, 0, Bhdrsize);
+    h[0] = 0xbe;
+    h[1] = op;
+    putle(h + 8, id, 8);
+    putle(h + 16, delay, 4);
+    putle(h + 20, ttr, 4);
+    putle(h + 24, n, 4);
+    c->wlen += Bhdrsize;
+}
+
+
+// Topup sends more commands, up to the pipelining depth.
+static void
+topup(Lconn *c)
+{
+    char hdr[64];
+    int n;
+
+    if (c->wlen > Rbufsize / 2) return; // let the server catch up
+    if (c->worker) {
+        if (batch) {
+            if (c->outstanding) return;
+            queuef(c, "reserve-batch %d 1\r\n", depth);
+            c->outstanding++;
+            return;
+        }
+        while (c->outstanding < depth) {
+            if (binproto) {
+                queueframe(c, Breservetimeout, 0, 1, 0, 0);
+            } else {
+                queue(c, "reserve-with-timeout 1\r\n", 24);
+            }
+            c->outstanding++;
+        }
+        return;
+    }
+    while (c->outstanding < depth && nput < njob) {
+        if (binproto) {
+            queueframe(c, Bput, 0, 0, 60, bodysize);
+        } else {
+            n = snprintf(hdr, sizeof hdr, "put 0 0 60 %d\r\n", bodysize);
+            queue(c, hdr, n);
+        }
+        c->sent[(c->shead + c->outstanding) % depth] = now();
+        snprintf(body, 21, "%020" PRId64, c->sent[(c->shead + c->outstanding) % depth]);
+        body[20] = 'x';
+        queue(c, body, bodysize);
+        if (!binproto) queue(c, "\r\n", 2);
+        c->outstanding++;
+        nput++;
+    }
+}
+
+
+// Gotjob handles a reserved job's body; p points at it.
+static void
+gotjob(Lconn *c, uint64 id, char *p)
+{
+    histadd(&e2ehist, now() - strtoll(p, NULL, 10));
+    nconsumed++;
+    if (batch) {
+        c->ids[c->nids++] = id;
+    } else if (binproto) {
+        queueframe(c, Bdelete, id, 0, 0, 0);
+    } else {
+        queuef(c, "delete %" PRIu64 "\r\n", id);
+    }
+}
+
+
+// Processbin is process for the binary protocol.
+static int
+processbin(Lconn *c)
+{
+    char *p = c->rbuf, *end = c->rbuf + c->rlen;
+    uint64 n;
+
+    while (end - p >= Bhdrsize) {
+        n = getle(p + 24, 4);
+        if (end - p < Bhdrsize + n) break; // wait for the whole body
+        switch (p[1]) {
+        case Breserved:
+            gotjob(c, getle(p + 8, 8), p + Bhdrsize);
+            c->outstanding--;
+            break;
+        case Binserted:
+            histadd(&puthist, now() - c->sent[c->shead]);
+            c->shead = (c->shead + 1) % depth;
+            c->outstanding--;
+            ninserted++;
+            break;
+        case Btimedout:
+            c->outstanding--;
+            break;
+        case Bdeleted:
+            break;
+        default:
+            fprintf(stderr, "loadgen: unexpected reply: status %d\n", p[1]);
+            exit(1);
+        }
+        p += Bhdrsize + n;
+    }
+    return p - c->rbuf;
+}
+
+
+// Process handles each complete reply in c->rbuf.
+// It returns the number of bytes used.
+static int
+process(Lconn *c)
+{
+    char *p = c->rbuf, *end = c->rbuf + c->rlen, *eol;
+    uint64 id;
+    int n, i, k;
+
+    if (binproto) return processbin(c);
+    while ((eol = memchr(p, '\n', end - p))) {
+        if (sscanf(p, "RESERVED %" SCNu64 " %d", &id, &n) == 2) {
+            if (end - (eol + 1) < n + 2) break; // wait for the whole body
+            gotjob(c, id, eol + 1);
+            eol += n + 2;
+            if (c->inbatch && !--c->inbatch) {
+                n = sprintf(c->wbuf + c->wlen, "delete-batch");
+                for (i = 0; i < c->nids; i++) {
+                    n += sprintf(c->wbuf + c->wlen + n, " %" PRIu64, c->ids[i]);
+                }
+                c->wlen += n + sprintf(c->wbuf + c->wlen + n, "\r\n");
+                c->nids = 0;
+                c->outstanding--;
+            } else if (!c->inbatch) {
+                c->outstanding--;
+            }
+        } else if (sscanf(p, "RESERVED-BATCH %d", &k) == 1) {
+            c->inbatch = k;
+        } else if (strncmp(p, "INSERTED ", 9) == 0) {
+            histadd(&puthist, now() - c->sent[c->shead]);
+            c->shead = (c->shead + 1) % depth;
+            c->outstanding--;
+            ninserted++;
+        } else if (strncmp(p, "TIMED_OUT", 9) == 0) {
+            c->outstanding--;
+        } else if (strncmp(p, "DELETED", 7) != 0) {
+            fprintf(stderr, "loadgen: unexpected reply: %.*s\n", (int)(eol - p), p);
+            exit(1);
+        }
+        p = eol + 1;
+    }
+    return p - c->rbuf;
+}
+
+
+static void
+readconn(Lconn *c)
+{
+    int n;
+
+    n = read(c->fd, c->rbuf + c->rlen, Rbufsize - c->rlen);
+    if (n == -1) {
+        if (errno == EAGAIN) return;
+        die("read");
+    }
+    if (n == 0) {
+        fprintf(stderr, "loadgen: server hung up\n");
+        exit(1);
+    }
+    c->rlen += n;
+    n = process(c);
+    memmove(c->rbuf, c->rbuf + n, c->rlen - n);
+    c->rlen -= n;
+}
+
+
+static void
+setup(char *host, char *port)
+{
+    int i, t;
+    Lconn *c;
+
+    nconn = nproducer + nworker;
+    conns = calloc(nconn, sizeof(Lconn));
+    if (!conns) die("calloc");
+    for (i = 0; i < nconn; i++) {
+        c = &conns[i];
+        c->fd = dial(host, port);
+        if (c->fd == -1) die("connect");
+        c->worker = i >= nproducer;
+        c->tube = i % ntube;
+        c->sent = calloc(depth, sizeof(int64));
+        c->ids = calloc(depth, sizeof(uint64));
+        c->rbuf = malloc(Rbufsize);
+        c->wbuf = malloc(Rbufsize + 2*bodysize + 1024);
+        if (!c->sent || !c->ids || !c->rbuf || !c->wbuf) die("malloc");
+
+        // set up tubes in lockstep, before going non-blocking
+        if (c->worker) {
+            for (t = 0; t < ntube; t++) queuef(c, "watch t%d\r\n", t);
+            queuef(c, "ignore default\r\n");
+        } else {
+            queuef(c, "use t%d\r\n", c->tube);
+        }
+        flush(c);
+        for (t = c->worker ? ntube + 1 : 1; t > 0; ) {
+            int n = read(c->fd, c->rbuf + c->rlen, Rbufsize - c->rlen);
+            if (n <= 0) die("read");
+            for (c->rlen += n; c->rlen; t--) {
+                char *eol = memchr(c->rbuf, '\n', c->rlen);
+                if (!eol) break;
+                n = eol + 1 - c->rbuf;
+                memmove(c->rbuf, eol + 1, c->rlen - n);
+                c->rlen -= n;
+            }
+        }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+
+static void
+report(int64 elapsed)
+{
+    double secs = elapsed / 1e9;
+    Hist *h[] = {&puthist, &e2ehist};
+    char *names[] = {"put", "put-to-reserve"};
+    int i;
+
+    printf("%d producers, %d workers, depth %d, %d tubes, %d-byte bodies%s%s%s\n",
+           nproducer, nworker, depth, ntube, bodysize,
+           batch ? ", batches" : "", binproto ? ", binary" : "", binlog ? ", binlog" : "");
+    printf("%" PRId64 " jobs in %.2fs: %.0f jobs/s\n", nconsumed, secs, nconsumed / secs);
+    printf("%-16s %10s %10s %10s %10s (us)\n", "latency", "p50", "p99", "p999", "max");
+    for (i = 0; i < 2; i++) {
+        printf("%-16s %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+               names[i],
+               histpct(h[i], 0.5) / 1000,
+               histpct(h[i], 0.99) / 1000,
+               histpct(h[i], 0.999) / 1000,
+               h[i]->max / 1000);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int i, r, ch;
+    char port[16], dir[] = "/tmp/loadgen.XXXXXX", *host = "127.0.0.1", *p;
+    pid_t pid = 0;
+    struct pollfd *fds;
+    int64 start;
+
+    while ((ch = getopt(argc, argv, "p:w:d:t:s:n:BPbf:x:a:")) != -1) {
+        switch (ch) {
+        case 'p': nproducer = atoi(optarg); break;
+        case 'w': nworker = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 't': ntube = atoi(optarg); break;
+        case 's': bodysize = atoi(optarg); break;
+        case 'n': njob = atoll(optarg); break;
+        case 'B': batch = 1; break;
+        case 'P': binproto = 1; break;
+        case 'b': binlog = 1; break;
+        case 'f': fsyncms = atoi(optarg); binlog = 1; break;
+        case 'x': srvpath = optarg; break;
+        case 'a': addr = optarg; break;
+        default: usage();
+        }
+    }
+    if (nproducer < 1 || nworker < 1 || depth < 1 || depth > 1000 ||
+        ntube < 1 || bodysize < 20 || bodysize > 1000000 || njob < 1 ||
+        (batch && binproto)) {
+        usage();
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    body = malloc(bodysize + 1);
+    if (!body) die("malloc");
+    memset(body, 'x', bodysize);
+
+    if (addr) {
+        host = addr;
+        p = strrchr(addr, ':');
+        if (!p) usage();
+        *p = '\0';
+        snprintf(port, sizeof port, "%s", p + 1);
+    } else {
+        snprintf(port, sizeof port, "%d", freeport());
+        if (binlog && !mkdtemp(dir)) die("mkdtemp");
+        pid = startserver(port, binlog ? dir : NULL);
+        for (i = 0; (r = dial(host, port)) == -1; i++) {
+            if (i == 500) {
+                fprintf(stderr, "loadgen: server didn't start\n");
+                exit(1);
+            }
+            usleep(10000);
+        }
+        close(r);
+    }
+
+    setup(host, port);
+    fds = calloc(nconn, sizeof(struct pollfd));
+    if (!fds) die("calloc");
+
+    start = now();
+    while (nconsumed < njob) {
+        for (i = 0; i < nconn; i++) {
+            topup(&conns[i]);
+            flush(&conns[i]);
+            fds[i].fd = conns[i].fd;
+            fds[i].events = POLLIN | (conns[i].wlen ? POLLOUT : 0);
+        }
+        r = poll(fds, nconn, 10000);
+        if (r == -1) die("poll");
+        if (r == 0) {
+            fprintf(stderr, "loadgen: stalled\n");
+            exit(1);
+        }
+        for (i = 0; i < nconn; i++) {
+            if (fds[i].revents & (POLLIN|POLLHUP|POLLERR)) readconn(&conns[i]);
+        }
+    }
+    report(now() - start);
+
+    if (pid) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (binlog) rmdir_all(dir);
+    }
+    return 0;
+}
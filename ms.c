@@ -10,6 +10,7 @@ ms_init(ms a, ms_event_fn oninsert, ms_event_fn onremove)
     a->items = NULL;
     a->oninsert = oninsert;
     a->onremove = onremove;
+    a->onmove = NULL;
 }
 
 static void
@@ -38,7 +39,8 @@ ms_append(ms a, void *item)
     return 1;
 }
 
-static int
+/* Remove the item at index i, moving the last item into its place. */
+int
 ms_delete(ms a, size_t i)
 {
     void *item;
@@ -46,6 +48,7 @@ ms_delete(ms a, size_t i)
     if (i >= a->used) return 0;
     item = a->items[i];
     a->items[i] = a->items[--a->used];
+    if (a->onmove && i < a->used) a->onmove(a, a->items[i], i);
 
     /* it has already been removed now */
     if (a->onremove) a->onremove(a, item, i);
@@ -57,7 +60,8 @@ ms_clear(ms a)
 {
     while (ms_delete(a, 0));
     free(a->items);
-    ms_init(a, a->oninsert, a->onremove);
+    a->used = a->cap = a->last = 0;
+    a->items = NULL;
 }
 
 int
@@ -5,11 +5,86 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include "dat.h"
 #include "sd-daemon.h"
 
+/* Prefix of a -l address naming a Unix domain socket. */
+#define UNIXPREFIX "unix:"
+
+/* Stale_unix_socket returns 1 if nothing is listening on the socket
+ * at addr, so it is left behind by an earlier run. */
+static int
+stale_unix_socket(struct sockaddr_un *addr)
+{
+    int fd, r;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return 0;
+    /* so a full backlog can't block us */
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    r = connect(fd, (struct sockaddr *)addr, sizeof *addr);
+    r = r == -1 && errno == ECONNREFUSED;
+    close(fd);
+    return r;
+}
+
+static int
+make_unix_socket(char *path)
+{
+    int fd, r;
+    struct stat st;
+    struct sockaddr_un addr = {};
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        twarnx("socket path too long: %s", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return twarn("socket()"), -1;
+    }
+
+    r = fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (r == -1) {
+        twarn("setting O_NONBLOCK");
+        close(fd);
+        return -1;
+    }
+
+    /* A socket left behind by an earlier run would make bind fail.
+     * One still in use is left alone, and bind fails. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+        stale_unix_socket(&addr)) {
+        unlink(path);
+    }
+
+    if (verbose) {
+        printf("bind %d %s%s\n", fd, UNIXPREFIX, path);
+    }
+    r = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    if (r == -1) {
+        twarn("bind()");
+        close(fd);
+        return -1;
+    }
+
+    r = listen(fd, 1024);
+    if (r == -1) {
+        twarn("listen()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 int
 make_server_socket(char *host, char *port)
 {
@@ -31,18 +106,25 @@ make_server_socket(char *host, char *port)
         }
         fd = SD_LISTEN_FDS_START;
         r = sd_is_socket_inet(fd, 0, SOCK_STREAM, 1, 0);
+        if (r == 0) {
+            r = sd_is_socket_unix(fd, SOCK_STREAM, 1, NULL, 0);
+        }
         if (r < 0) {
             errno = -r;
-            twarn("sd_is_socket_inet");
+            twarn("sd_is_socket");
             return -1;
         }
         if (!r) {
-            twarnx("inherited fd is not a TCP listen socket");
+            twarnx("inherited fd is not a TCP or Unix listen socket");
             return -1;
         }
         return fd;
     }
 
+    if (host && strncmp(host, UNIXPREFIX, strlen(UNIXPREFIX)) == 0) {
+        return make_unix_socket(host + strlen(UNIXPREFIX));
+    }
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -24,18 +24,24 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "0123456789-+/;.$_()"
 
 #define CMD_PUT "put "
+#define CMD_PUT_BATCH "put-batch "
 #define CMD_PEEKJOB "peek "
 #define CMD_PEEK_READY "peek-ready"
 #define CMD_PEEK_DELAYED "peek-delayed"
 #define CMD_PEEK_BURIED "peek-buried"
 #define CMD_RESERVE "reserve"
 #define CMD_RESERVE_TIMEOUT "reserve-with-timeout "
+#define CMD_RESERVE_BATCH "reserve-batch "
 #define CMD_DELETE "delete "
+#define CMD_DELETE_BATCH "delete-batch "
 #define CMD_RELEASE "release "
+#define CMD_RELEASE_BATCH "release-batch "
 #define CMD_BURY "bury "
 #define CMD_KICK "kick "
 #define CMD_JOBKICK "kick-job "
 #define CMD_TOUCH "touch "
+#define CMD_TOUCH_BATCH "touch-batch "
+#define CMD_STATS_LATENCY "stats-latency"
 #define CMD_STATS "stats"
 #define CMD_JOBSTATS "stats-job "
 #define CMD_USE "use "
@@ -46,36 +52,27 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_LIST_TUBES_WATCHED "list-tubes-watched"
 #define CMD_STATS_TUBE "stats-tube "
 #define CMD_QUIT "quit"
-#define CMD_PAUSE_TUBE "pause-tube"
+#define CMD_PAUSE_TUBE "pause-tube "
 
 #define CONSTSTRLEN(m) (sizeof(m) - 1)
 
 #define CMD_PEEK_READY_LEN CONSTSTRLEN(CMD_PEEK_READY)
 #define CMD_PEEK_DELAYED_LEN CONSTSTRLEN(CMD_PEEK_DELAYED)
 #define CMD_PEEK_BURIED_LEN CONSTSTRLEN(CMD_PEEK_BURIED)
-#define CMD_PEEKJOB_LEN CONSTSTRLEN(CMD_PEEKJOB)
 #define CMD_RESERVE_LEN CONSTSTRLEN(CMD_RESERVE)
-#define CMD_RESERVE_TIMEOUT_LEN CONSTSTRLEN(CMD_RESERVE_TIMEOUT)
-#define CMD_DELETE_LEN CONSTSTRLEN(CMD_DELETE)
-#define CMD_RELEASE_LEN CONSTSTRLEN(CMD_RELEASE)
-#define CMD_BURY_LEN CONSTSTRLEN(CMD_BURY)
-#define CMD_KICK_LEN CONSTSTRLEN(CMD_KICK)
-#define CMD_JOBKICK_LEN CONSTSTRLEN(CMD_JOBKICK)
-#define CMD_TOUCH_LEN CONSTSTRLEN(CMD_TOUCH)
+#define CMD_DELETE_BATCH_LEN CONSTSTRLEN(CMD_DELETE_BATCH)
+#define CMD_RELEASE_BATCH_LEN CONSTSTRLEN(CMD_RELEASE_BATCH)
+#define CMD_TOUCH_BATCH_LEN CONSTSTRLEN(CMD_TOUCH_BATCH)
 #define CMD_STATS_LEN CONSTSTRLEN(CMD_STATS)
-#define CMD_JOBSTATS_LEN CONSTSTRLEN(CMD_JOBSTATS)
-#define CMD_USE_LEN CONSTSTRLEN(CMD_USE)
-#define CMD_WATCH_LEN CONSTSTRLEN(CMD_WATCH)
-#define CMD_IGNORE_LEN CONSTSTRLEN(CMD_IGNORE)
+#define CMD_STATS_LATENCY_LEN CONSTSTRLEN(CMD_STATS_LATENCY)
 #define CMD_LIST_TUBES_LEN CONSTSTRLEN(CMD_LIST_TUBES)
 #define CMD_LIST_TUBE_USED_LEN CONSTSTRLEN(CMD_LIST_TUBE_USED)
 #define CMD_LIST_TUBES_WATCHED_LEN CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
-#define CMD_STATS_TUBE_LEN CONSTSTRLEN(CMD_STATS_TUBE)
-#define CMD_PAUSE_TUBE_LEN CONSTSTRLEN(CMD_PAUSE_TUBE)
 
 #define MSG_FOUND "FOUND"
 #define MSG_NOTFOUND "NOT_FOUND\r\n"
 #define MSG_RESERVED "RESERVED"
+#define MSG_RESERVED_BATCH_FMT "RESERVED-BATCH %d\r\n"
 #define MSG_DEADLINE_SOON "DEADLINE_SOON\r\n"
 #define MSG_TIMED_OUT "TIMED_OUT\r\n"
 #define MSG_DELETED "DELETED\r\n"
@@ -85,15 +82,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_TOUCHED "TOUCHED\r\n"
 #define MSG_BURIED_FMT "BURIED %"PRIu64"\r\n"
 #define MSG_INSERTED_FMT "INSERTED %"PRIu64"\r\n"
+#define MSG_INSERTED_BATCH_FMT "INSERTED-BATCH %"PRIu64" %d\r\n"
+#define MSG_DELETED_BATCH_FMT "DELETED-BATCH %d\r\n"
+#define MSG_RELEASED_BATCH_FMT "RELEASED-BATCH %d\r\n"
+#define MSG_TOUCHED_BATCH_FMT "TOUCHED-BATCH %d\r\n"
 #define MSG_NOT_IGNORED "NOT_IGNORED\r\n"
 
 #define MSG_NOTFOUND_LEN CONSTSTRLEN(MSG_NOTFOUND)
-#define MSG_DELETED_LEN CONSTSTRLEN(MSG_DELETED)
-#define MSG_TOUCHED_LEN CONSTSTRLEN(MSG_TOUCHED)
-#define MSG_RELEASED_LEN CONSTSTRLEN(MSG_RELEASED)
-#define MSG_BURIED_LEN CONSTSTRLEN(MSG_BURIED)
-#define MSG_KICKED_LEN CONSTSTRLEN(MSG_KICKED)
-#define MSG_NOT_IGNORED_LEN CONSTSTRLEN(MSG_NOT_IGNORED)
 
 #define MSG_OUT_OF_MEMORY "OUT_OF_MEMORY\r\n"
 #define MSG_INTERNAL_ERROR "INTERNAL_ERROR\r\n"
@@ -110,7 +105,10 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define STATE_WAIT 4
 #define STATE_BITBUCKET 5
 #define STATE_CLOSE 6
+#define STATE_KICK 7
 
+/* These are also the op codes of the binary protocol, so don't
+ * renumber them. */
 #define OP_UNKNOWN 0
 #define OP_PUT 1
 #define OP_PEEKJOB 2
@@ -136,7 +134,60 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define OP_QUIT 22
 #define OP_PAUSE_TUBE 23
 #define OP_JOBKICK 24
-#define TOTAL_OPS 25
+#define OP_PUT_BATCH 25
+#define OP_RESERVE_BATCH 26
+#define OP_DELETE_BATCH 27
+#define OP_RELEASE_BATCH 28
+#define OP_TOUCH_BATCH 29
+#define OP_STATS_LATENCY 30
+#define TOTAL_OPS 31
+
+/* the most jobs one batch command may carry */
+#define MAX_BATCH 10000
+
+/* past this many body bytes, reserve-batch takes no more jobs */
+#define MAX_BATCH_BYTES (1 << 20)
+
+/* the most jobs a kick moves in one pass of the event loop; see kick_more */
+#define KICK_CHUNK 16384
+
+/* The binary protocol; see dispatch_bin and doc/protocol.txt. Every frame,
+ * either way, starts with a header of BIN_HDR_SIZE bytes:
+ *
+ *   0  magic   1 byte, BIN_MAGIC
+ *   1  op      1 byte, an OP_ number; in a reply, a BIN_ status
+ *   2  zero    2 bytes
+ *   4  pri     4 bytes; in a reply, a count
+ *   8  id      8 bytes
+ *   16 delay   4 bytes, seconds; for reserve-with-timeout, the timeout
+ *   20 ttr     4 bytes, seconds
+ *   24 len     4 bytes, of the body or tube name that follows
+ *   28 zero    4 bytes
+ *
+ * Numbers are little-endian. */
+#define BIN_MAGIC 0xbe
+#define BIN_HDR_SIZE 32
+
+#define BIN_INSERTED 1
+#define BIN_BURIED 2
+#define BIN_RESERVED 3
+#define BIN_FOUND 4
+#define BIN_DELETED 5
+#define BIN_RELEASED 6
+#define BIN_TOUCHED 7
+#define BIN_KICKED 8
+#define BIN_USING 9
+#define BIN_WATCHING 10
+#define BIN_NOT_FOUND 11
+#define BIN_NOT_IGNORED 12
+#define BIN_DEADLINE_SOON 13
+#define BIN_TIMED_OUT 14
+#define BIN_JOB_TOO_BIG 15
+#define BIN_DRAINING 16
+#define BIN_OUT_OF_MEMORY 17
+#define BIN_INTERNAL_ERROR 18
+#define BIN_BAD_FORMAT 19
+#define BIN_UNKNOWN_COMMAND 20
 
 #define STATS_FMT "---\n" \
     "current-jobs-urgent: %u\n" \
@@ -166,6 +217,12 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "cmd-list-tube-used: %" PRIu64 "\n" \
     "cmd-list-tubes-watched: %" PRIu64 "\n" \
     "cmd-pause-tube: %" PRIu64 "\n" \
+    "cmd-put-batch: %" PRIu64 "\n" \
+    "cmd-reserve-batch: %" PRIu64 "\n" \
+    "cmd-delete-batch: %" PRIu64 "\n" \
+    "cmd-release-batch: %" PRIu64 "\n" \
+    "cmd-touch-batch: %" PRIu64 "\n" \
+    "cmd-stats-latency: %" PRIu64 "\n" \
     "job-timeouts: %" PRIu64 "\n" \
     "total-jobs: %" PRIu64 "\n" \
     "max-job-size: %zu\n" \
@@ -184,7 +241,14 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "binlog-current-index: %d\n" \
     "binlog-records-migrated: %" PRId64 "\n" \
     "binlog-records-written: %" PRId64 "\n" \
+    "binlog-bytes-migrated: %" PRId64 "\n" \
+    "binlog-migrate-rate: %" PRId64 "\n" \
+    "binlog-dead-ratio: %.2f\n" \
     "binlog-max-size: %d\n" \
+    "binlog-snapshots: %" PRId64 "\n" \
+    "job-pool-bytes: %zu\n" \
+    "job-pool-used: %zu\n" \
+    "job-pool-free: %zu\n" \
     "id: %s\n" \
     "hostname: %s\n" \
     "\r\n"
@@ -203,8 +267,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "cmd-delete: %" PRIu64 "\n" \
     "cmd-pause-tube: %u\n" \
     "pause: %" PRIu64 "\n" \
-    "pause-time-left: %" PRId64 "\n" \
-    "\r\n"
+    "pause-time-left: %" PRId64 "\n"
 
 #define STATS_JOB_FMT "---\n" \
     "id: %" PRIu64 "\n" \
@@ -229,6 +292,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 static char bucket[BUCKET_BUF_SIZE];
 
 static uint ready_ct = 0;
+static uint delayed_ct = 0;
 static struct stats global_stat = {0, 0, 0, 0, 0};
 
 static tube default_tube;
@@ -245,8 +309,24 @@ static char id[NumIdBytes * 2 + 1]; // hex-encoded len of NumIdBytes
 static struct utsname node_info;
 static uint64 op_ct[TOTAL_OPS], timeout_ct = 0;
 
+/* how long each command takes, how long jobs wait to be reserved,
+ * and how long they're reserved for before they're deleted */
+static Hist op_hist[TOTAL_OPS], wait_hist, run_hist;
+
 static Conn *dirty;
 
+/* Conns whose replies wait for the wal to be flushed, and those
+ * protflush has yet to get to. */
+static Conn *held, *flushing;
+
+/* Tubes that have both a ready job and a waiting conn, and are not paused,
+ * ordered by the priority of their first ready job. */
+static Heap ready_tubes;
+
+/* Tubes that have a delayed job, ordered by the deadline of their first
+ * delayed job. */
+static Heap delay_tubes;
+
 static const char * op_names[] = {
     "<unknown>",
     CMD_PUT,
@@ -273,9 +353,68 @@ static const char * op_names[] = {
     CMD_QUIT,
     CMD_PAUSE_TUBE,
     CMD_JOBKICK,
+    CMD_PUT_BATCH,
+    CMD_RESERVE_BATCH,
+    CMD_DELETE_BATCH,
+    CMD_RELEASE_BATCH,
+    CMD_TOUCH_BATCH,
+    CMD_STATS_LATENCY,
 };
 
+static int read_pri(uint *pri, char **p);
+static int at_eol(Conn *c, const char *p);
 static job remove_buried_job(job j);
+static job remove_delayed_job(job j);
+static job remove_ready_job(job j);
+static int enqueue_job(Server *s, job j, int64 delay, char update_store);
+static int bury_job(Server *s, job j, char update_store);
+static job remove_this_reserved_job(Conn *c, job j);
+static void maybe_enqueue_incoming_job(Conn *c);
+
+static int
+ready_tube_less(tube a, tube b)
+{
+    return job_pri_less(a->ready.data[0].j, b->ready.data[0].j);
+}
+
+static void
+ready_tube_rec(tube t, int i)
+{
+    t->readypos = i;
+}
+
+/* Must be called whenever t's ready heap, waiting set, or pause state
+ * changes, before any other tube is touched. The insert can't fail,
+ * since prot_add_tube made room for every tube. */
+static void
+update_ready_tube(tube t)
+{
+    if (t->readypos > -1) heapremove(&ready_tubes, t->readypos);
+    if (t->pause || !t->waiting.used || !t->ready.len) return;
+    if (!heapinsert(&ready_tubes, t)) twarnx("OOM indexing tube %s", t->name);
+}
+
+static int
+delay_tube_less(tube a, tube b)
+{
+    return job_delay_less(a->delay.data[0].j, b->delay.data[0].j);
+}
+
+static void
+delay_tube_rec(tube t, int i)
+{
+    t->delaypos = i;
+}
+
+/* Must be called whenever t's delay heap changes, before any other tube
+ * is touched. As above, the insert can't fail. */
+static void
+update_delay_tube(tube t)
+{
+    if (t->delaypos > -1) heapremove(&delay_tubes, t->delaypos);
+    if (!t->delay.len) return;
+    if (!heapinsert(&delay_tubes, t)) twarnx("OOM indexing tube %s", t->name);
+}
 
 static int
 buried_job_p(tube t)
@@ -283,29 +422,144 @@ buried_job_p(tube t)
     return job_list_any_p(&t->buried);
 }
 
+/* Put c on the dirty list, unless it is already there. */
 static void
-reply(Conn *c, char *line, int len, int state)
+mark_dirty(Conn *c)
 {
-    if (!c) return;
-
-    connwant(c, 'w');
+    if (c->dirty) return;
+    c->dirty = 1;
     c->next = dirty;
     dirty = c;
-    c->reply = line;
+}
+
+static void
+reply_out(Conn *c, char *buf, int len, int state)
+{
+    connwant(c, 'w');
+    mark_dirty(c);
+    c->reply = buf;
     c->reply_len = len;
     c->reply_sent = 0;
     c->state = state;
+}
+
+static uint32
+getle32(const char *p)
+{
+    const byte *b = (const byte *)p;
+
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32)b[3] << 24;
+}
+
+static uint64
+getle64(const char *p)
+{
+    return getle32(p) | (uint64)getle32(p + 4) << 32;
+}
+
+static void
+putle32(char *p, uint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void
+putle64(char *p, uint64 v)
+{
+    putle32(p, v);
+    putle32(p + 4, v >> 32);
+}
+
+/* Make a binary reply header in c->reply_buf. */
+static char *
+binhdr(Conn *c, byte status, uint64 id, uint32 n, uint32 len)
+{
+    char *h = c->reply_buf;
+
+    memset(h, 0, BIN_HDR_SIZE);
+    h[0] = (char)BIN_MAGIC;
+    h[1] = status;
+    putle32(h + 4, n);
+    putle64(h + 8, id);
+    putle32(h + 24, len);
     if (verbose >= 2) {
+        printf(">%d reply binary %d %"PRIu64" %u\n", c->sock.fd, status, id, n);
+    }
+    return h;
+}
+
+/* Send a binary reply header, followed by len bytes of c->out_job's body
+ * if state is STATE_SENDJOB. */
+static void
+reply_bin(Conn *c, int state, byte status, uint64 id, uint32 n, uint32 len)
+{
+    reply_out(c, binhdr(c, status, id, n, len), BIN_HDR_SIZE, state);
+}
+
+typedef struct Stword {
+    char *msg;
+    int  len;
+} Stword;
+
+#define STWORD(b, m) [b] = { (m), CONSTSTRLEN(m) }
+
+/* The text reply for each status that is a word and nothing more. */
+static Stword stwords[] = {
+    STWORD(BIN_BURIED, MSG_BURIED),
+    STWORD(BIN_DELETED, MSG_DELETED),
+    STWORD(BIN_RELEASED, MSG_RELEASED),
+    STWORD(BIN_TOUCHED, MSG_TOUCHED),
+    STWORD(BIN_KICKED, MSG_KICKED),
+    STWORD(BIN_NOT_FOUND, MSG_NOTFOUND),
+    STWORD(BIN_NOT_IGNORED, MSG_NOT_IGNORED),
+    STWORD(BIN_DEADLINE_SOON, MSG_DEADLINE_SOON),
+    STWORD(BIN_TIMED_OUT, MSG_TIMED_OUT),
+    STWORD(BIN_JOB_TOO_BIG, MSG_JOB_TOO_BIG),
+    STWORD(BIN_DRAINING, MSG_DRAINING),
+    STWORD(BIN_OUT_OF_MEMORY, MSG_OUT_OF_MEMORY),
+    STWORD(BIN_INTERNAL_ERROR, MSG_INTERNAL_ERROR),
+    STWORD(BIN_BAD_FORMAT, MSG_BAD_FORMAT),
+    STWORD(BIN_UNKNOWN_COMMAND, MSG_UNKNOWN_COMMAND),
+};
+
+/* Log server error status e, and give it back. */
+#define serr(e) (twarnx("server error: %s", stwords[e].msg), (e))
+
+/* Send line, or for a binary client, the header already made in it. */
+static void
+reply(Conn *c, char *line, int len, int state)
+{
+    if (!c) return;
+
+    if (verbose >= 2 && !c->binary) {
         printf(">%d reply %.*s\n", c->sock.fd, len-2, line);
     }
+    reply_out(c, line, len, state);
+}
+
+/* Send the reply for status st, which is in stwords, in whichever
+ * protocol c speaks. */
+static void
+reply_st(Conn *c, byte st)
+{
+    if (!c) return;
+
+    if (c->binary) return reply_bin(c, STATE_SENDWORD, st, 0, 0, 0);
+    reply(c, stwords[st].msg, stwords[st].len, STATE_SENDWORD);
 }
 
+#define reply_sterr(c,e) reply_st((c), serr(e))
 
 static void
 protrmdirty(Conn *c)
 {
     Conn *x, *newdirty = NULL;
 
+    if (!c->dirty) return;
+    c->dirty = 0;
     while (dirty) {
         x = dirty;
         dirty = dirty->next;
@@ -320,6 +574,44 @@ protrmdirty(Conn *c)
 }
 
 
+/* Unlink c from the list at *l, if it is there. */
+static void
+unhold(Conn **l, Conn *c)
+{
+    for (; *l; l = &(*l)->hnext) {
+        if (*l == c) {
+            *l = c->hnext;
+            c->hnext = NULL;
+            return;
+        }
+    }
+}
+
+static void
+protrmheld(Conn *c)
+{
+    if (!c->held) return;
+    c->held = 0;
+    unhold(&held, c);
+    unhold(&flushing, c);
+}
+
+/* If c's reply would tell of records not yet on disk, hold it back
+ * until protflush, once the wal has been flushed, and return 1.
+ * That way every command of a pass shares one write and one fsync. */
+static int
+hold(Conn *c)
+{
+    if (!walpending(&c->srv->wal)) return 0;
+    if (!c->held) {
+        c->held = 1;
+        c->hnext = held;
+        held = c;
+    }
+    return 1;
+}
+
+
 #define reply_msg(c,m) reply((c),(m),CONSTSTRLEN(m),STATE_SENDWORD)
 
 #define reply_serr(c,e) (twarnx("server error: %s",(e)),\
@@ -345,13 +637,31 @@ reply_line(Conn *c, int state, const char *fmt, ...)
     return reply(c, c->reply_buf, r, state);
 }
 
+/* How many bytes of j's body go over the wire to or from c. Binary
+ * clients deal in bodies without the "\r\n" that ends each stored one. */
+static int
+wire_size(Conn *c, job j)
+{
+    return j->r.body_size - (c->binary ? 2 : 0);
+}
+
+/* Send j with binary status st, or text reply word, to c. */
 static void
-reply_job(Conn *c, job j, const char *word)
+reply_job(Conn *c, job j, byte st, const char *word)
 {
+    /* send an uncompressed copy, freed once it's sent */
+    if (j->r.raw_size) {
+        j = job_copy(j);
+        if (!j) return reply_sterr(c, BIN_INTERNAL_ERROR);
+    }
+
     /* tell this connection which job to send */
     c->out_job = j;
     c->out_job_sent = 0;
 
+    if (c->binary) {
+        return reply_bin(c, STATE_SENDJOB, st, j->r.id, 0, j->r.body_size - 2);
+    }
     return reply_line(c, STATE_SENDJOB, "%s %"PRIu64" %u\r\n",
                       word, j->r.id, j->r.body_size - 2);
 }
@@ -369,86 +679,209 @@ remove_waiting_conn(Conn *c)
     for (i = 0; i < c->watch.used; i++) {
         t = c->watch.items[i];
         t->stat.waiting_ct--;
-        ms_remove(&t->waiting, c);
+        ms_delete(&t->waiting, c->waiters[i].pos);
+        update_ready_tube(t);
     }
     return c;
 }
 
+/* Record v in the server-wide Hist h and in the tube's *th, making *th
+ * if need be. */
+static void
+add_latency(Hist *h, Hist **th, int64 v)
+{
+    histadd(h, v);
+    if (!*th) *th = new(Hist); /* if this fails, the tube goes without */
+    if (*th) histadd(*th, v);
+}
+
+static void
+note_reserve(job j, int64 now)
+{
+    j->reserved_at = now;
+    if (JOBCT(j, reserve_ct) == 1) {
+        add_latency(&wait_hist, &j->tube->waithist, now - j->r.created_at);
+    }
+}
+
+/* j is about to be deleted */
+static void
+note_delete(job j)
+{
+    if (j->r.state != Reserved) return;
+    add_latency(&run_hist, &j->tube->runhist, nanoseconds() - j->reserved_at);
+}
+
 static void
 reserve_job(Conn *c, job j)
 {
-    j->r.deadline_at = nanoseconds() + j->r.ttr;
+    int64 now = nanoseconds();
+
+    j->r.deadline_at = now + j->r.ttr;
+    if (!jobheapinsert(&c->deadlines, j, j->r.deadline_at)) {
+        if (enqueue_job(c->srv, j, 0, 0) < 1) bury_job(c->srv, j, 0);
+        return reply_sterr(c, BIN_OUT_OF_MEMORY);
+    }
     global_stat.reserved_ct++; /* stats */
     j->tube->stat.reserved_ct++;
-    j->r.reserve_ct++;
+    job_ct(j)->reserve_ct++;
+    note_reserve(j, now);
     j->r.state = Reserved;
     job_insert(&c->reserved_jobs, j);
     j->reserver = c;
     c->pending_timeout = -1;
-    if (c->soonest_job && j->r.deadline_at < c->soonest_job->r.deadline_at) {
-        c->soonest_job = j;
-    }
-    return reply_job(c, j, MSG_RESERVED);
+    return reply_job(c, j, BIN_RESERVED, MSG_RESERVED);
+}
+
+/* Tubes in a batch heap only ever come out from the top, so they
+ * needn't know where they are in it. */
+static void
+batch_tube_rec(tube t, int i)
+{
 }
 
+/* Take the most urgent ready job from the tubes in h, a heap of them by
+ * ready_tube_less, unless there is none or it would take the bodies
+ * taken so far, size bytes, past MAX_BATCH_BYTES. */
 static job
-next_eligible_job(int64 now)
+take_batch_job(Heap *h, int size)
 {
     tube t;
-    size_t i;
-    job j = NULL, candidate;
+    job j;
 
-    for (i = 0; i < tubes.used; i++) {
-        t = tubes.items[i];
-        if (t->pause) {
-            if (t->deadline_at > now) continue;
-            t->pause = 0;
+    if (!h->len) return NULL;
+    t = h->data[0];
+    j = t->ready.data[0].j;
+    if (size + job_bodysize(j) > MAX_BATCH_BYTES) return NULL;
+    heapremove(h, 0);
+    remove_ready_job(j);
+    if (t->ready.len) heapinsert(h, t); /* there's room; t just came out */
+    return j;
+}
+
+/* Reserve j, which is already out of its ready queue, and then as many more
+ * ready jobs from the tubes c watches as c asked for in reserve-batch, most
+ * urgent first. Send them all back in a single reply. */
+static void
+reserve_batch(Conn *c, job j)
+{
+    int i, n = 0, size = 0;
+    int64 now = nanoseconds();
+    job b, head = &c->reserved_jobs;
+    char *p;
+    int ioerr = 0;
+    tube t;
+    Heap h = {.less = (Less)ready_tube_less, .rec = (Record)batch_tube_rec};
+
+    /* if this runs out of memory, the batch comes from fewer tubes */
+    for (i = 0; i < c->watch.used; i++) {
+        t = c->watch.items[i];
+        if (t->pause || !t->ready.len) continue;
+        if (!heapinsert(&h, t)) break;
+    }
+
+    for (; j; j = n < c->reserve_max ? take_batch_job(&h, size) : NULL) {
+        j->r.deadline_at = now + j->r.ttr;
+        if (!jobheapinsert(&c->deadlines, j, j->r.deadline_at)) {
+            /* send what we have, if anything */
+            if (enqueue_job(c->srv, j, 0, 0) < 1) bury_job(c->srv, j, 0);
+            break;
         }
-        if (t->waiting.used && t->ready.len) {
-            candidate = t->ready.data[0];
-            if (!j || job_pri_less(candidate, j)) {
-                j = candidate;
+        global_stat.reserved_ct++; /* stats */
+        j->tube->stat.reserved_ct++;
+        job_ct(j)->reserve_ct++;
+        note_reserve(j, now);
+        j->r.state = Reserved;
+        job_insert(head, j);
+        j->reserver = c;
+        size += snprintf(NULL, 0, "%s %"PRIu64" %u\r\n",
+                         MSG_RESERVED, j->r.id, job_bodysize(j) - 2);
+        size += job_bodysize(j);
+        n++;
+    }
+    free(h.data);
+    c->reserve_max = 0;
+    c->pending_timeout = -1;
+    if (!n) return reply_serr(c, MSG_OUT_OF_MEMORY);
+
+    /* the new jobs are the last n in c->reserved_jobs */
+    b = allocate_job(size + 1); /* fake job to hold the reply */
+    if (b) {
+        b->r.state = Copy;
+        for (j = head->prev, i = 1; i < n; i++) j = j->prev;
+        for (p = b->body; j != head; j = j->next) {
+            p += sprintf(p, "%s %"PRIu64" %u\r\n",
+                         MSG_RESERVED, j->r.id, job_bodysize(j) - 2);
+            if (!job_readbody(j, p)) {
+                job_free(b);
+                b = NULL;
+                ioerr = 1;
+                break;
             }
+            p += job_bodysize(j);
+        }
+    }
+    if (!b) {
+        /* put them back */
+        for (i = 0; i < n; i++) {
+            j = remove_this_reserved_job(c, head->prev);
+            job_ct(j)->reserve_ct--;
+            if (enqueue_job(c->srv, j, 0, 0) < 1) bury_job(c->srv, j, 0);
         }
+        if (ioerr) return reply_serr(c, MSG_INTERNAL_ERROR);
+        return reply_serr(c, MSG_OUT_OF_MEMORY);
     }
 
-    return j;
+    /* tell this connection which job to send */
+    c->out_job = b;
+    c->out_job_sent = 0;
+    b->r.body_size = size;
+    reply_line(c, STATE_SENDJOB, MSG_RESERVED_BATCH_FMT, n);
+}
+
+static job
+next_eligible_job()
+{
+    tube t;
+
+    if (!ready_tubes.len) return NULL;
+    t = ready_tubes.data[0];
+    return t->ready.data[0].j;
 }
 
 static void
 process_queue()
 {
     job j;
-    int64 now = nanoseconds();
+    tube t;
+    Conn *c;
 
-    while ((j = next_eligible_job(now))) {
-        heapremove(&j->tube->ready, j->heap_index);
+    while ((j = next_eligible_job())) {
+        t = j->tube;
+        jobheapremove(&t->ready, j->heap_index);
         ready_ct--;
         if (j->r.pri < URGENT_THRESHOLD) {
             global_stat.urgent_ct--;
-            j->tube->stat.urgent_ct--;
+            t->stat.urgent_ct--;
+        }
+        c = remove_waiting_conn(((Waiter *) ms_take(&t->waiting))->c);
+        update_ready_tube(t);
+        if (c->reserve_max) {
+            reserve_batch(c, j);
+        } else {
+            reserve_job(c, j);
         }
-        reserve_job(remove_waiting_conn(ms_take(&j->tube->waiting)), j);
     }
 }
 
 static job
 delay_q_peek()
 {
-    int i;
     tube t;
-    job j = NULL, nj;
-
-    for (i = 0; i < tubes.used; i++) {
-        t = tubes.items[i];
-        if (t->delay.len == 0) {
-            continue;
-        }
-        nj = t->delay.data[0];
-        if (!j || nj->r.deadline_at < j->r.deadline_at) j = nj;
-    }
 
-    return j;
+    if (!delay_tubes.len) return NULL;
+    t = delay_tubes.data[0];
+    return t->delay.data[0].j;
 }
 
 static int
@@ -459,12 +892,15 @@ enqueue_job(Server *s, job j, int64 delay, char update_store)
     j->reserver = NULL;
     if (delay) {
         j->r.deadline_at = nanoseconds() + delay;
-        r = heapinsert(&j->tube->delay, j);
+        r = jobheapinsert(&j->tube->delay, j, j->r.deadline_at);
         if (!r) return 0;
+        update_delay_tube(j->tube);
+        delayed_ct++;
         j->r.state = Delayed;
     } else {
-        r = heapinsert(&j->tube->ready, j);
+        r = jobheapinsert(&j->tube->ready, j, j->r.pri);
         if (!r) return 0;
+        update_ready_tube(j->tube);
         j->r.state = Ready;
         ready_ct++;
         if (j->r.pri < URGENT_THRESHOLD) {
@@ -477,7 +913,12 @@ enqueue_job(Server *s, job j, int64 delay, char update_store)
         if (!walwrite(&s->wal, j)) {
             return 0;
         }
-        walmaint(&s->wal);
+    }
+
+    if (!delay) {
+        walunspill(&s->wal, j);
+    } else if (s->wal.spill && delay >= s->wal.spilldelay) {
+        walspill(&s->wal, j);
     }
 
     process_queue();
@@ -500,15 +941,15 @@ bury_job(Server *s, job j, char update_store)
     j->tube->stat.buried_ct++;
     j->r.state = Buried;
     j->reserver = NULL;
-    j->r.bury_ct++;
+    job_ct(j)->bury_ct++;
 
     if (update_store) {
         if (!walwrite(&s->wal, j)) {
             return 0;
         }
-        walmaint(&s->wal);
     }
 
+    if (s->wal.spill) walspill(&s->wal, j);
     return 1;
 }
 
@@ -520,23 +961,18 @@ enqueue_reserved_jobs(Conn *c)
 
     while (job_list_any_p(&c->reserved_jobs)) {
         j = job_remove(c->reserved_jobs.next);
+        jobheapremove(&c->deadlines, j->heap_index);
         r = enqueue_job(c->srv, j, 0, 0);
         if (r < 1) bury_job(c->srv, j, 0);
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
-        c->soonest_job = NULL;
     }
 }
 
 static job
 delay_q_take()
 {
-    job j = delay_q_peek();
-    if (!j) {
-        return 0;
-    }
-    heapremove(&j->tube->delay, j->heap_index);
-    return j;
+    return remove_delayed_job(delay_q_peek());
 }
 
 static int
@@ -551,7 +987,7 @@ kick_buried_job(Server *s, job j)
 
     remove_buried_job(j);
 
-    j->r.kick_ct++;
+    job_ct(j)->kick_ct++;
     r = enqueue_job(s, j, 0, 1);
     if (r == 1) return 1;
 
@@ -560,20 +996,6 @@ kick_buried_job(Server *s, job j)
     return 0;
 }
 
-static uint
-get_delayed_job_ct()
-{
-    tube t;
-    size_t i;
-    uint count = 0;
-
-    for (i = 0; i < tubes.used; i++) {
-        t = tubes.items[i];
-        count += t->delay.len;
-    }
-    return count;
-}
-
 static int
 kick_delayed_job(Server *s, job j)
 {
@@ -584,9 +1006,9 @@ kick_delayed_job(Server *s, job j)
     if (!z) return 0;
     j->walresv += z;
 
-    heapremove(&j->tube->delay, j->heap_index);
+    remove_delayed_job(j);
 
-    j->r.kick_ct++;
+    job_ct(j)->kick_ct++;
     r = enqueue_job(s, j, 0, 1);
     if (r == 1) return 1;
 
@@ -599,33 +1021,162 @@ kick_delayed_job(Server *s, job j)
     return 0;
 }
 
+/* Move the n jobs in jobs, already taken out of t's buried list or
+ * delay heap, to t's ready heap. Each has had WAL space reserved for
+ * its update, and t->ready has room for all of them. They are added
+ * unordered and the heap is fixed up once, rather than sifting each
+ * one in.
+ * Each kick is written to the WAL first, stopping at the first that
+ * can't be. Returns the number of jobs moved; the rest are left as
+ * they were, for the caller to put back. */
+static uint
+kick_bulk(Server *s, tube t, job *jobs, uint n)
+{
+    uint i, m;
+    int k = t->ready.len, state;
+    job j;
+
+    for (m = 0; m < n; m++) {
+        j = jobs[m];
+        state = j->r.state;
+        job_ct(j)->kick_ct++;
+        j->r.state = Ready;
+        if (!walwrite(&s->wal, j)) {
+            job_ct(j)->kick_ct--;
+            j->r.state = state;
+            break;
+        }
+    }
+    if (!m) return 0;
+
+    for (i = 0; i < m; i++) {
+        j = jobs[i];
+        j->reserver = NULL;
+        jobheappush(&t->ready, j, j->r.pri);
+        ready_ct++;
+        if (j->r.pri < URGENT_THRESHOLD) {
+            global_stat.urgent_ct++;
+            t->stat.urgent_ct++;
+        }
+    }
+    jobheapfix(&t->ready, k);
+    update_ready_tube(t);
+
+    for (i = 0; i < m; i++) walunspill(&s->wal, jobs[i]);
+    process_queue();
+    return m;
+}
+
 /* return the number of jobs successfully kicked */
 static uint
 kick_buried_jobs(Server *s, tube t, uint n)
 {
-    uint i;
-    for (i = 0; (i < n) && buried_job_p(t); ++i) {
-        kick_buried_job(s, t->buried.next);
+    uint i, m;
+    job j, *jobs;
+
+    n = min(n, t->stat.buried_ct);
+    jobs = n > 1 && jobheapgrow(&t->ready, n) ? malloc(n * sizeof *jobs) : NULL;
+    if (!jobs) {
+        /* one at a time, then */
+        for (i = 0; (i < n) && buried_job_p(t); ++i) {
+            kick_buried_job(s, t->buried.next);
+        }
+        return i;
+    }
+
+    for (i = 0, j = t->buried.next; i < n; i++, j = j->next) jobs[i] = j;
+    if (!walresvupdaten(&s->wal, jobs, n)) {
+        free(jobs);
+        return 0;
+    }
+    for (i = 0; i < n; i++) remove_buried_job(jobs[i]);
+    m = kick_bulk(s, t, jobs, n);
+
+    /* back to the front of the list, in order */
+    for (i = n; i-- > m; ) {
+        job_insert(t->buried.next, jobs[i]);
+        global_stat.buried_ct++;
+        t->stat.buried_ct++;
     }
-    return i;
+    free(jobs);
+    return m;
 }
 
 /* return the number of jobs successfully kicked */
 static uint
 kick_delayed_jobs(Server *s, tube t, uint n)
 {
-    uint i;
-    for (i = 0; (i < n) && (t->delay.len > 0); ++i) {
-        kick_delayed_job(s, (job)t->delay.data[0]);
+    uint i, m;
+    int all;
+    job *jobs;
+
+    n = min(n, t->delay.len);
+    jobs = n > 1 && jobheapgrow(&t->ready, n) ? malloc(n * sizeof *jobs) : NULL;
+    if (!jobs) {
+        /* one at a time, then */
+        for (i = 0; (i < n) && (t->delay.len > 0); ++i) {
+            kick_delayed_job(s, t->delay.data[0].j);
+        }
+        return i;
+    }
+
+    /* the earliest n, in order, unless that's all of them */
+    all = n == t->delay.len;
+    for (i = 0; i < n; i++) {
+        jobs[i] = t->delay.data[all ? i : 0].j;
+        if (!all) jobheapremove(&t->delay, 0);
+    }
+    if (!walresvupdaten(&s->wal, jobs, n)) {
+        /* put back any taken out; the heap still has room */
+        for (i = 0; i < n; i++) {
+            if (jobs[i]->heap_index == -1) {
+                jobheapinsert(&t->delay, jobs[i], jobs[i]->r.deadline_at);
+            }
+        }
+        update_delay_tube(t);
+        free(jobs);
+        return 0;
+    }
+    if (all) t->delay.len = 0;
+    delayed_ct -= n;
+    m = kick_bulk(s, t, jobs, n);
+    for (i = m; i < n; i++) {
+        jobheapinsert(&t->delay, jobs[i], jobs[i]->r.deadline_at);
+        delayed_ct++;
     }
-    return i;
+    update_delay_tube(t);
+    free(jobs);
+    return m;
 }
 
-static uint
-kick_jobs(Server *s, tube t, uint n)
+/* Kick the next chunk of c's kick command. A kick of more than
+ * KICK_CHUNK jobs is spread over several passes of the event loop,
+ * so that other clients are served in between; c waits in
+ * STATE_KICK, and prottick calls back here (see conntickat). Once
+ * there is nothing more to kick, reply. */
+static void
+kick_more(Conn *c)
 {
-    if (buried_job_p(t)) return kick_buried_jobs(s, t, n);
-    return kick_delayed_jobs(s, t, n);
+    uint n, i;
+    tube t = c->use;
+
+    n = min(c->kick_left, KICK_CHUNK);
+    if (c->kick_buried) {
+        i = buried_job_p(t) ? kick_buried_jobs(c->srv, t, n) : 0;
+    } else {
+        i = kick_delayed_jobs(c->srv, t, n);
+    }
+    c->kick_ct += i;
+    c->kick_left -= n;
+    if (i < n) c->kick_left = 0;
+
+    if (!c->kick_left) {
+        reply_line(c, STATE_SENDWORD, "KICKED %u\r\n", c->kick_ct);
+        return;
+    }
+    c->state = STATE_KICK;
+    connwant(c, 'h'); // only care if they hang up
+    mark_dirty(c);
 }
 
 static job
@@ -644,7 +1195,9 @@ static job
 remove_delayed_job(job j)
 {
     if (!j || j->r.state != Delayed) return NULL;
-    heapremove(&j->tube->delay, j->heap_index);
+    jobheapremove(&j->tube->delay, j->heap_index);
+    update_delay_tube(j->tube);
+    delayed_ct--;
 
     return j;
 }
@@ -653,7 +1206,8 @@ static job
 remove_ready_job(job j)
 {
     if (!j || j->r.state != Ready) return NULL;
-    heapremove(&j->tube->ready, j->heap_index);
+    jobheapremove(&j->tube->ready, j->heap_index);
+    update_ready_tube(j->tube);
     ready_ct--;
     if (j->r.pri < URGENT_THRESHOLD) {
         global_stat.urgent_ct--;
@@ -662,19 +1216,33 @@ remove_ready_job(job j)
     return j;
 }
 
-static void
+/* Returns 1 on success, 0 on OOM. */
+static int
 enqueue_waiting_conn(Conn *c)
 {
     tube t;
     size_t i;
+    Waiter *w;
+
+    if (c->waiters_cap < c->watch.used) {
+        w = realloc(c->waiters, c->watch.cap * sizeof(Waiter));
+        if (!w) return 0;
+        c->waiters = w;
+        c->waiters_cap = c->watch.cap;
+    }
 
     global_stat.waiting_ct++;
     c->type |= CONN_TYPE_WAITING;
     for (i = 0; i < c->watch.used; i++) {
         t = c->watch.items[i];
         t->stat.waiting_ct++;
-        ms_append(&t->waiting, c);
+        w = &c->waiters[i];
+        w->c = c;
+        w->pos = -1;
+        ms_append(&t->waiting, w);
+        update_ready_tube(t);
     }
+    return 1;
 }
 
 static job
@@ -689,7 +1257,7 @@ touch_job(Conn *c, job j)
     j = find_reserved_job_in_conn(c, j);
     if (j) {
         j->r.deadline_at = nanoseconds() + j->r.ttr;
-        c->soonest_job = NULL;
+        jobheapupdate(&c->deadlines, j->heap_index, j->r.deadline_at);
     }
     return j;
 }
@@ -728,61 +1296,159 @@ scan_line_end(const char *s, int size)
     return 0;
 }
 
+/* The length of the binary frame at c->cmd, not counting the body of
+ * a put, or 0 if it is not all there yet. A tube name too long to be
+ * one is not counted either; see dispatch_bin. */
 static int
-cmd_len(Conn *c)
+bin_len(Conn *c)
 {
-    return scan_line_end(c->cmd, c->cmd_read);
-}
+    uint32 n;
 
-/* parse the command line */
-static int
-which_cmd(Conn *c)
-{
-#define TEST_CMD(s,c,o) if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o);
-    TEST_CMD(c->cmd, CMD_PUT, OP_PUT);
-    TEST_CMD(c->cmd, CMD_PEEKJOB, OP_PEEKJOB);
-    TEST_CMD(c->cmd, CMD_PEEK_READY, OP_PEEK_READY);
-    TEST_CMD(c->cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
-    TEST_CMD(c->cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
-    TEST_CMD(c->cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
-    TEST_CMD(c->cmd, CMD_RESERVE, OP_RESERVE);
-    TEST_CMD(c->cmd, CMD_DELETE, OP_DELETE);
-    TEST_CMD(c->cmd, CMD_RELEASE, OP_RELEASE);
-    TEST_CMD(c->cmd, CMD_BURY, OP_BURY);
-    TEST_CMD(c->cmd, CMD_KICK, OP_KICK);
-    TEST_CMD(c->cmd, CMD_JOBKICK, OP_JOBKICK);
-    TEST_CMD(c->cmd, CMD_TOUCH, OP_TOUCH);
-    TEST_CMD(c->cmd, CMD_JOBSTATS, OP_JOBSTATS);
-    TEST_CMD(c->cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
-    TEST_CMD(c->cmd, CMD_STATS, OP_STATS);
-    TEST_CMD(c->cmd, CMD_USE, OP_USE);
-    TEST_CMD(c->cmd, CMD_WATCH, OP_WATCH);
-    TEST_CMD(c->cmd, CMD_IGNORE, OP_IGNORE);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
-    TEST_CMD(c->cmd, CMD_QUIT, OP_QUIT);
-    TEST_CMD(c->cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
-    return OP_UNKNOWN;
+    if (c->cmd_read < BIN_HDR_SIZE) return 0;
+    n = getle32(c->cmd + 24);
+    if (c->cmd[1] == OP_PUT || n > MAX_TUBE_NAME_LEN - 1) n = 0;
+    n += BIN_HDR_SIZE;
+    return c->cmd_read >= n ? n : 0;
 }
 
-/* Copy up to body_size trailing bytes into the job, then the rest into the cmd
- * buffer. If c->in_job exists, this assumes that c->in_job->body is empty.
- * This function is idempotent(). */
-static void
-fill_extra_data(Conn *c)
+static int
+cmd_len(Conn *c)
 {
-    int extra_bytes, job_data_bytes = 0, cmd_bytes;
+    /* no text command starts this way, so it's a binary client */
+    if (c->cmd_read && (byte)c->cmd[0] == BIN_MAGIC) c->binary = 1;
 
-    if (!c->sock.fd) return; /* the connection was closed */
-    if (!c->cmd_len) return; /* we don't have a complete command */
+    if (c->binary) return bin_len(c);
+    return scan_line_end(c->cmd, c->cmd_read);
+}
 
-    /* how many extra bytes did we read? */
-    extra_bytes = c->cmd_read - c->cmd_len;
+typedef struct Cmd {
+    const char *name;
+    int        len;
+    byte       op;
+} Cmd;
 
-    /* how many bytes should we put into the job body? */
+#define CMD(s, o) { (s), CONSTSTRLEN(s), (o) }
+
+/* The commands, grouped by first letter. Where one name is a prefix of
+ * another, the longer one must come first. */
+static Cmd cmds_b[] = {
+    CMD(CMD_BURY, OP_BURY),
+    {0},
+};
+static Cmd cmds_d[] = {
+    CMD(CMD_DELETE, OP_DELETE),
+    CMD(CMD_DELETE_BATCH, OP_DELETE_BATCH),
+    {0},
+};
+static Cmd cmds_i[] = {
+    CMD(CMD_IGNORE, OP_IGNORE),
+    {0},
+};
+static Cmd cmds_k[] = {
+    CMD(CMD_KICK, OP_KICK),
+    CMD(CMD_JOBKICK, OP_JOBKICK),
+    {0},
+};
+static Cmd cmds_l[] = {
+    CMD(CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED),
+    CMD(CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED),
+    CMD(CMD_LIST_TUBES, OP_LIST_TUBES),
+    {0},
+};
+static Cmd cmds_p[] = {
+    CMD(CMD_PUT, OP_PUT),
+    CMD(CMD_PUT_BATCH, OP_PUT_BATCH),
+    CMD(CMD_PEEKJOB, OP_PEEKJOB),
+    CMD(CMD_PEEK_READY, OP_PEEK_READY),
+    CMD(CMD_PEEK_DELAYED, OP_PEEK_DELAYED),
+    CMD(CMD_PEEK_BURIED, OP_PEEK_BURIED),
+    CMD(CMD_PAUSE_TUBE, OP_PAUSE_TUBE),
+    {0},
+};
+static Cmd cmds_q[] = {
+    CMD(CMD_QUIT, OP_QUIT),
+    {0},
+};
+static Cmd cmds_r[] = {
+    CMD(CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT),
+    CMD(CMD_RESERVE_BATCH, OP_RESERVE_BATCH),
+    CMD(CMD_RESERVE, OP_RESERVE),
+    CMD(CMD_RELEASE, OP_RELEASE),
+    CMD(CMD_RELEASE_BATCH, OP_RELEASE_BATCH),
+    {0},
+};
+static Cmd cmds_s[] = {
+    CMD(CMD_STATS_LATENCY, OP_STATS_LATENCY),
+    CMD(CMD_JOBSTATS, OP_JOBSTATS),
+    CMD(CMD_STATS_TUBE, OP_STATS_TUBE),
+    CMD(CMD_STATS, OP_STATS),
+    {0},
+};
+static Cmd cmds_t[] = {
+    CMD(CMD_TOUCH, OP_TOUCH),
+    CMD(CMD_TOUCH_BATCH, OP_TOUCH_BATCH),
+    {0},
+};
+static Cmd cmds_u[] = {
+    CMD(CMD_USE, OP_USE),
+    {0},
+};
+static Cmd cmds_w[] = {
+    CMD(CMD_WATCH, OP_WATCH),
+    {0},
+};
+
+static Cmd *cmdtab[26] = {
+    ['b'-'a'] = cmds_b,
+    ['d'-'a'] = cmds_d,
+    ['i'-'a'] = cmds_i,
+    ['k'-'a'] = cmds_k,
+    ['l'-'a'] = cmds_l,
+    ['p'-'a'] = cmds_p,
+    ['q'-'a'] = cmds_q,
+    ['r'-'a'] = cmds_r,
+    ['s'-'a'] = cmds_s,
+    ['t'-'a'] = cmds_t,
+    ['u'-'a'] = cmds_u,
+    ['w'-'a'] = cmds_w,
+};
+
+/* parse the command line, and point *args just past the command's name */
+static int
+which_cmd(Conn *c, char **args)
+{
+    Cmd *cmd;
+    int len = c->cmd_len - 2;
+    uint i = (byte) c->cmd[0] - 'a';
+
+    *args = c->cmd;
+    if (i >= 26 || !cmdtab[i]) return OP_UNKNOWN;
+    for (cmd = cmdtab[i]; cmd->name; cmd++) {
+        if (len >= cmd->len && memcmp(c->cmd, cmd->name, cmd->len) == 0) {
+            *args = c->cmd + cmd->len;
+            return cmd->op;
+        }
+    }
+    return OP_UNKNOWN;
+}
+
+/* Copy up to body_size trailing bytes into the job, then the rest into the cmd
+ * buffer. If c->in_job exists, this assumes that c->in_job->body is empty.
+ * This function is idempotent(). */
+static void
+fill_extra_data(Conn *c)
+{
+    int extra_bytes, job_data_bytes = 0, cmd_bytes;
+
+    if (!c->sock.fd) return; /* the connection was closed */
+    if (!c->cmd_len) return; /* we don't have a complete command */
+
+    /* how many extra bytes did we read? */
+    extra_bytes = c->cmd_read - c->cmd_len;
+
+    /* how many bytes should we put into the job body? */
     if (c->in_job) {
-        job_data_bytes = min(extra_bytes, c->in_job->r.body_size);
+        job_data_bytes = min(extra_bytes, wire_size(c, c->in_job));
         memcpy(c->in_job->body, c->cmd + c->cmd_len, job_data_bytes);
         c->in_job_read = job_data_bytes;
     } else if (c->in_job_read) {
@@ -798,8 +1464,9 @@ fill_extra_data(Conn *c)
     c->cmd_len = 0; /* we no longer know the length of the new command */
 }
 
+/* Throw away the next n bytes from c, then reply with status st. */
 static void
-_skip(Conn *c, int n, char *line, int len)
+skip(Conn *c, int n, byte st)
 {
     /* Invert the meaning of in_job_read while throwing away data -- it
      * counts the bytes that remain to be thrown away. */
@@ -807,17 +1474,19 @@ _skip(Conn *c, int n, char *line, int len)
     c->in_job_read = n;
     fill_extra_data(c);
 
-    if (c->in_job_read == 0) return reply(c, line, len, STATE_SENDWORD);
+    if (c->in_job_read == 0) return reply_st(c, st);
 
-    c->reply = line;
-    c->reply_len = len;
+    c->reply = stwords[st].msg;
+    c->reply_len = stwords[st].len;
+    if (c->binary) {
+        c->reply = binhdr(c, st, 0, 0, 0);
+        c->reply_len = BIN_HDR_SIZE;
+    }
     c->reply_sent = 0;
     c->state = STATE_BITBUCKET;
     return;
 }
 
-#define skip(c,n,m) (_skip(c,n,m,CONSTSTRLEN(m)))
-
 static void
 enqueue_incoming_job(Conn *c)
 {
@@ -839,27 +1508,170 @@ enqueue_incoming_job(Conn *c)
 
     if (drain_mode) {
         job_free(j);
-        return reply_serr(c, MSG_DRAINING);
+        return reply_sterr(c, BIN_DRAINING);
     }
 
-    if (j->walresv) return reply_serr(c, MSG_INTERNAL_ERROR);
+    job_zip(j);
+    if (j->walresv) return reply_sterr(c, BIN_INTERNAL_ERROR);
     j->walresv = walresvput(&c->srv->wal, j);
-    if (!j->walresv) return reply_serr(c, MSG_OUT_OF_MEMORY);
+    if (!j->walresv) return reply_sterr(c, BIN_OUT_OF_MEMORY);
 
     /* we have a complete job, so let's stick it in the pqueue */
     r = enqueue_job(c->srv, j, j->r.delay, 1);
-    if (r < 0) return reply_serr(c, MSG_INTERNAL_ERROR);
+    if (r < 0) return reply_sterr(c, BIN_INTERNAL_ERROR);
 
     global_stat.total_jobs_ct++;
     j->tube->stat.total_jobs_ct++;
 
-    if (r == 1) return reply_line(c, STATE_SENDWORD, MSG_INSERTED_FMT, j->r.id);
+    if (r == 1) {
+        if (c->binary) {
+            return reply_bin(c, STATE_SENDWORD, BIN_INSERTED, j->r.id, 0, 0);
+        }
+        return reply_line(c, STATE_SENDWORD, MSG_INSERTED_FMT, j->r.id);
+    }
 
     /* out of memory trying to grow the queue, so it gets buried */
     bury_job(c->srv, j, 0);
+    if (c->binary) {
+        return reply_bin(c, STATE_SENDWORD, BIN_BURIED, j->r.id, 0, 0);
+    }
     reply_line(c, STATE_SENDWORD, MSG_BURIED_FMT, j->r.id);
 }
 
+static void
+free_batch(Conn *c)
+{
+    int i;
+
+    for (i = 0; i < c->batch_read; i++) job_free(c->batch[i]);
+    free(c->batch);
+    c->batch = NULL;
+    c->batch_read = c->batch_ct = 0;
+    c->batch_err = NULL;
+}
+
+/* All the bodies of a put-batch are in. Insert the jobs, or none of them
+ * if any one failed. */
+static void
+enqueue_batch(Conn *c)
+{
+    int i, r, n = c->batch_ct;
+    uint64 id = c->batch_id;
+    job j;
+
+    if (!c->batch_err && drain_mode) c->batch_err = MSG_DRAINING;
+    if (!c->batch_err && !walresvputn(&c->srv->wal, c->batch, n)) {
+        c->batch_err = MSG_OUT_OF_MEMORY;
+    }
+    if (c->batch_err) {
+        char *e = c->batch_err;
+
+        free_batch(c);
+        return reply(c, e, strlen(e), STATE_SENDWORD);
+    }
+
+    for (i = 0; i < n; i++) {
+        j = c->batch[i];
+        r = enqueue_job(c->srv, j, j->r.delay, 1);
+
+        global_stat.total_jobs_ct++;
+        j->tube->stat.total_jobs_ct++;
+
+        /* out of memory trying to grow the queue, so it gets buried */
+        if (r < 1) bury_job(c->srv, j, 0);
+    }
+
+    /* the jobs belong to their tubes now */
+    c->batch_read = 0;
+    free_batch(c);
+    reply_line(c, STATE_SENDWORD, MSG_INSERTED_BATCH_FMT, id, n);
+}
+
+/* Done with one body of a put-batch; go on to the next one. */
+static void
+batch_next(Conn *c)
+{
+    c->batch_read++;
+    if (c->batch_read == c->batch_ct) return enqueue_batch(c);
+    c->state = STATE_WANTCOMMAND;
+}
+
+/* A put-batch body is complete. Keep it if it is well formed. */
+static void
+batch_add_job(Conn *c)
+{
+    job j = c->in_job;
+
+    c->in_job = NULL; /* the batch owns this job now */
+    c->in_job_read = 0;
+
+    /* check if the trailer is present and correct */
+    if (memcmp(j->body + j->r.body_size - 2, "\r\n", 2)) {
+        job_free(j);
+        j = NULL;
+        if (!c->batch_err) c->batch_err = MSG_EXPECTED_CRLF;
+    } else {
+        if (verbose >= 2) printf("<%d job %"PRIu64"\n", c->sock.fd, j->r.id);
+        job_zip(j);
+    }
+
+    c->batch[c->batch_read] = j;
+    batch_next(c);
+}
+
+/* Throw away n bytes of a put-batch body, then go on to the next one. */
+static void
+batch_skip(Conn *c, int n, char *err)
+{
+    if (!c->batch_err) c->batch_err = err;
+    c->batch[c->batch_read] = NULL;
+
+    c->in_job = 0;
+    c->in_job_read = n;
+    fill_extra_data(c);
+
+    if (c->in_job_read == 0) return batch_next(c);
+    c->state = STATE_BITBUCKET;
+}
+
+/* Handle the "<bytes>" line in front of each body of a put-batch. */
+static void
+batch_line(Conn *c)
+{
+    uint body_size;
+    char *p = c->cmd;
+    job j;
+
+    /* NUL-terminate this string so the parser can stop at its end */
+    c->cmd[c->cmd_len - 2] = '\0';
+
+    /* a body with a bad trailer can leave part of it in front of us */
+    while (*p == '\r' || *p == '\n') p++;
+    if (read_pri(&body_size, &p) || !at_eol(c, p)) {
+        /* we can no longer tell where the bodies are */
+        free_batch(c);
+        return reply_msg(c, MSG_BAD_FORMAT);
+    }
+
+    if (body_size > job_data_size_limit) {
+        return batch_skip(c, body_size + 2, MSG_JOB_TOO_BIG);
+    }
+    if (c->batch_err) return batch_skip(c, body_size + 2, c->batch_err);
+
+    j = make_job_with_id(c->batch_pri, c->batch_delay, c->batch_ttr,
+                         body_size + 2, c->use, c->batch_id + c->batch_read);
+    if (!j) {
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        return batch_skip(c, body_size + 2, MSG_OUT_OF_MEMORY);
+    }
+
+    c->in_job = j;
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    maybe_enqueue_incoming_job(c);
+}
+
 static uint
 uptime()
 {
@@ -870,10 +1682,12 @@ static int
 fmt_stats(char *buf, size_t size, void *x)
 {
     int whead = 0, wcur = 0;
+    size_t pool_bytes, pool_used, pool_free;
     Server *srv;
     struct rusage ru = {{0, 0}, {0, 0}};
 
     srv = x;
+    job_pool_stats(&pool_bytes, &pool_used, &pool_free);
 
     if (srv->wal.head) {
         whead = srv->wal.head->seq;
@@ -888,7 +1702,7 @@ fmt_stats(char *buf, size_t size, void *x)
             global_stat.urgent_ct,
             ready_ct,
             global_stat.reserved_ct,
-            get_delayed_job_ct(),
+            delayed_ct,
             global_stat.buried_ct,
             op_ct[OP_PUT],
             op_ct[OP_PEEKJOB],
@@ -912,6 +1726,12 @@ fmt_stats(char *buf, size_t size, void *x)
             op_ct[OP_LIST_TUBE_USED],
             op_ct[OP_LIST_TUBES_WATCHED],
             op_ct[OP_PAUSE_TUBE],
+            op_ct[OP_PUT_BATCH],
+            op_ct[OP_RESERVE_BATCH],
+            op_ct[OP_DELETE_BATCH],
+            op_ct[OP_RELEASE_BATCH],
+            op_ct[OP_TOUCH_BATCH],
+            op_ct[OP_STATS_LATENCY],
             timeout_ct,
             global_stat.total_jobs_ct,
             job_data_size_limit,
@@ -930,88 +1750,163 @@ fmt_stats(char *buf, size_t size, void *x)
             wcur,
             srv->wal.nmig,
             srv->wal.nrec,
+            srv->wal.nmigbytes,
+            nanoseconds() - srv->wal.ratetime < 2000000000 ?
+                srv->wal.migrate_rate : 0,
+            srv->wal.use ? waldeadratio(&srv->wal) : 0.0,
             srv->wal.filesize,
+            srv->wal.nsnap,
+            pool_bytes,
+            pool_used,
+            pool_free,
             id,
             node_info.nodename);
 
 }
 
-/* Read a priority value from the given buffer and place it in pri.
- * Update end to point to the address after the last character consumed.
- * Pri and end can be NULL. If they are both NULL, read_pri() will do the
- * conversion and return the status code but not update any values. This is an
- * easy way to check for errors.
- * If end is NULL, read_pri will also check that the entire input string was
- * consumed and return an error code otherwise.
- * Return 0 on success, or nonzero on failure.
- * If a failure occurs, pri and end are not modified. */
 static int
-read_pri(uint *pri, const char *buf, char **end)
+fmt_stats_latency(char *buf, size_t size, void *x)
 {
-    char *tend;
-    uint tpri;
+    Server *srv = x;
+    char name[32];
+    int i, n;
+
+    n = snprintf(buf, size, "---\n");
+    for (i = 1; i < TOTAL_OPS; i++) {
+        /* "put " => "cmd-put" */
+        snprintf(name, sizeof name, "cmd-%.*s",
+                 (int) strcspn(op_names[i], " "), op_names[i]);
+        n = fmthist(buf, size, n, name, &op_hist[i]);
+    }
+    n = fmthist(buf, size, n, "queue-wait", &wait_hist);
+    n = fmthist(buf, size, n, "job-run", &run_hist);
+    n = fmthist(buf, size, n, "wal-write", &srv->wal.writehist);
+    n = fmthist(buf, size, n, "wal-flush", &srv->wal.flushhist);
+    n = fmthist(buf, size, n, "wal-sync", &srv->wal.synchist);
+    n = fmthist(buf, size, n, "loop-tick", &srv->tickhist);
+    n = fmthist(buf, size, n, "loop-event", &srv->eventhist);
+    return n + snprintf(buf ? buf + n : NULL, size > n ? size - n : 0, "\r\n");
+}
 
-    errno = 0;
-    while (buf[0] == ' ') buf++;
-    if (buf[0] < '0' || '9' < buf[0]) return -1;
-    tpri = strtoul(buf, &tend, 10);
-    if (tend == buf) return -1;
-    if (errno && errno != ERANGE) return -1;
-    if (!end && tend[0] != '\0') return -1;
+/* The argument parsers below each read one argument from *p, skipping any
+ * spaces in front of it, and advance *p past it. An argument must be
+ * followed by a space or the end of the line, so trailing garbage is
+ * caught in the same scan. They return 0 on success, or -1 on failure, in
+ * which case nothing is updated. An embedded NUL looks like the end of
+ * the line to them, so callers finish with at_eol(). */
 
-    if (pri) *pri = tpri;
-    if (end) *end = tend;
+/* Return true if p is at the end of c's command line. */
+static int
+at_eol(Conn *c, const char *p)
+{
+    return p == c->cmd + c->cmd_len - 2;
+}
+
+/* Read an unsigned decimal number no bigger than max. */
+static int
+read_num(uint64 *v, char **p, uint64 max)
+{
+    char *s = *p;
+    uint64 n = 0;
+    uint d;
+
+    while (*s == ' ') s++;
+    if (*s < '0' || '9' < *s) return -1;
+    for (; '0' <= *s && *s <= '9'; s++) {
+        d = *s - '0';
+        if (n > (max - d) / 10) return -1;
+        n = n*10 + d;
+    }
+    if (*s != ' ' && *s != '\0') return -1;
+
+    *v = n;
+    *p = s;
     return 0;
 }
 
-/* Read a delay value from the given buffer and place it in delay.
- * The interface and behavior are analogous to read_pri(). */
+/* Read a priority, or any other 32-bit count. */
 static int
-read_delay(int64 *delay, const char *buf, char **end)
+read_pri(uint *pri, char **p)
 {
-    int r;
-    uint delay_sec;
+    uint64 v;
+
+    if (read_num(&v, p, UINT32_MAX)) return -1;
+    *pri = v;
+    return 0;
+}
 
-    r = read_pri(&delay_sec, buf, end);
-    if (r) return r;
-    *delay = ((int64) delay_sec) * 1000000000;
+/* Read a delay in seconds and store it in delay as nanoseconds. */
+static int
+read_delay(int64 *delay, char **p)
+{
+    uint64 v;
+
+    if (read_num(&v, p, UINT32_MAX)) return -1;
+    *delay = ((int64) v) * 1000000000;
     return 0;
 }
 
-/* Read a timeout value from the given buffer and place it in ttr.
- * The interface and behavior are the same as in read_delay(). */
+/* Read a time-to-run; the same as a delay. */
 static int
-read_ttr(int64 *ttr, const char *buf, char **end)
+read_ttr(int64 *ttr, char **p)
 {
-    return read_delay(ttr, buf, end);
+    return read_delay(ttr, p);
 }
 
-/* Read a tube name from the given buffer moving the buffer to the name start */
+/* Read a job id. */
 static int
-read_tube_name(char **tubename, char *buf, char **end)
+read_id(uint64 *id, char **p)
 {
+    return read_num(id, p, UINT64_MAX);
+}
+
+/* Read a reserve timeout in seconds. A negative one means wait forever. */
+static int
+read_timeout(int *timeout, char **p)
+{
+    char *s = *p;
+    uint64 v;
+    int neg;
+
+    while (*s == ' ') s++;
+    neg = *s == '-';
+    s += neg;
+    if (neg && (*s < '0' || '9' < *s)) return -1;
+    if (read_num(&v, &s, INT32_MAX)) return -1;
+    *timeout = neg ? -(int)v : (int)v;
+    *p = s;
+    return 0;
+}
+
+/* Read a tube name. It is not NUL-terminated, unless it ends the line. */
+static int
+read_tube_name(char **tubename, char **p)
+{
+    char *s = *p;
     size_t len;
 
-    while (buf[0] == ' ') buf++;
-    len = strspn(buf, NAME_CHARS);
-    if (len == 0) return -1;
-    if (tubename) *tubename = buf;
-    if (end) *end = buf + len;
+    while (*s == ' ') s++;
+    len = strspn(s, NAME_CHARS);
+    if (len == 0 || len > MAX_TUBE_NAME_LEN - 1 || s[0] == '-') return -1;
+    if (s[len] != ' ' && s[len] != '\0') return -1;
+
+    *tubename = s;
+    *p = s + len;
     return 0;
 }
 
-static void
+static int
 wait_for_job(Conn *c, int timeout)
 {
+    if (!enqueue_waiting_conn(c)) return 0;
     c->state = STATE_WAIT;
-    enqueue_waiting_conn(c);
 
     /* Set the pending timeout to the requested timeout amount */
     c->pending_timeout = timeout;
 
     connwant(c, 'h'); // only care if they hang up
-    c->next = dirty;
-    dirty = c;
+    mark_dirty(c);
+    return 1;
 }
 
 typedef int(*fmt_fn)(char *, size_t, void *);
@@ -1100,24 +1995,25 @@ fmt_job_stats(char *buf, size_t size, job j)
             j->r.ttr / 1000000000,
             time_left,
             file,
-            j->r.reserve_ct,
-            j->r.timeout_ct,
-            j->r.release_ct,
-            j->r.bury_ct,
-            j->r.kick_ct);
+            JOBCT(j, reserve_ct),
+            JOBCT(j, timeout_ct),
+            JOBCT(j, release_ct),
+            JOBCT(j, bury_ct),
+            JOBCT(j, kick_ct));
 }
 
 static int
 fmt_stats_tube(char *buf, size_t size, tube t)
 {
     uint64 time_left;
+    int n;
 
     if (t->pause > 0) {
         time_left = (t->deadline_at - nanoseconds()) / 1000000000;
     } else {
         time_left = 0;
     }
-    return snprintf(buf, size, STATS_TUBE_FMT,
+    n = snprintf(buf, size, STATS_TUBE_FMT,
             t->name,
             t->stat.urgent_ct,
             t->ready.len,
@@ -1132,6 +2028,9 @@ fmt_stats_tube(char *buf, size_t size, tube t)
             t->stat.pause_ct,
             t->pause / 1000000000,
             time_left);
+    n = fmthist(buf, size, n, "queue-wait", t->waithist);
+    n = fmthist(buf, size, n, "job-run", t->runhist);
+    return n + snprintf(buf ? buf + n : NULL, size > n ? size - n : 0, "\r\n");
 }
 
 static void
@@ -1140,7 +2039,10 @@ maybe_enqueue_incoming_job(Conn *c)
     job j = c->in_job;
 
     /* do we have a complete job? */
-    if (c->in_job_read == j->r.body_size) return enqueue_incoming_job(c);
+    if (c->in_job_read == wire_size(c, j)) {
+        if (c->batch) return batch_add_job(c);
+        return enqueue_incoming_job(c);
+    }
 
     /* otherwise we have incomplete data, so just keep waiting */
     c->state = STATE_WANTDATA;
@@ -1152,11 +2054,11 @@ remove_this_reserved_job(Conn *c, job j)
 {
     j = job_remove(j);
     if (j) {
+        jobheapremove(&c->deadlines, j->heap_index);
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
         j->reserver = NULL;
     }
-    c->soonest_job = NULL;
     return j;
 }
 
@@ -1166,92 +2068,391 @@ remove_reserved_job(Conn *c, job j)
     return remove_this_reserved_job(c, find_reserved_job_in_conn(c, j));
 }
 
-static int
-name_is_ok(const char *name, size_t max)
+/* Make room in the tube indexes for t, just added to tubes, so that
+ * update_ready_tube and update_delay_tube never run out of memory.
+ * Returns 1 on success, or 0 if out of memory. */
+int
+prot_add_tube(tube t)
 {
-    size_t len = strlen(name);
-    return len > 0 && len <= max &&
-        strspn(name, NAME_CHARS) == len && name[0] != '-';
+    return heapgrow(&ready_tubes, tubes.used - ready_tubes.len) &&
+           heapgrow(&delay_tubes, tubes.used - delay_tubes.len);
 }
 
 void
 prot_remove_tube(tube t)
 {
+    if (t->readypos > -1) heapremove(&ready_tubes, t->readypos);
+    if (t->delaypos > -1) heapremove(&delay_tubes, t->delaypos);
     ms_remove(&tubes, t);
 }
 
+/* Read the list of job ids, separated by spaces, that ends c's command line,
+ * starting at p, into a new array. Return the number of ids read, or -1 if
+ * the list is malformed or empty, or we run out of memory. */
+static int
+read_ids(Conn *c, uint64 **ids, char *p)
+{
+    int n = 0;
+    char *q, *eol = c->cmd + c->cmd_len - 2;
+
+    for (q = p; q < eol; q++) n += *q == ' ';
+    *ids = malloc((n + 1) * sizeof(uint64));
+    if (!*ids) return -1;
+
+    for (n = 0; !read_id(&(*ids)[n], &p); n++);
+    while (*p == ' ') p++;
+    if (!at_eol(c, p) || !n) {
+        free(*ids);
+        return -1;
+    }
+    return n;
+}
+
+static void
+delete_batch(Conn *c, uint64 *ids, int n)
+{
+    int i, r, ok = 1, ct = 0;
+    job j;
+
+    for (i = 0; i < n; i++) {
+        j = job_find(ids[i]);
+        j = remove_reserved_job(c, j) ? :
+            remove_ready_job(j) ? :
+            remove_buried_job(j) ? :
+            remove_delayed_job(j);
+        if (!j) continue;
+
+        note_delete(j);
+        j->tube->stat.total_delete_ct++;
+
+        j->r.state = Invalid;
+        r = walwrite(&c->srv->wal, j);
+        job_free(j);
+        ok &= r;
+        ct++;
+    }
+
+    if (!ok) return reply_serr(c, MSG_INTERNAL_ERROR);
+    reply_line(c, STATE_SENDWORD, MSG_DELETED_BATCH_FMT, ct);
+}
+
+static void
+release_batch(Conn *c, uint64 *ids, int n, uint pri, int64 delay)
+{
+    int i, r, ct = 0;
+    job j, *js;
+
+    js = malloc(n * sizeof(job));
+    if (!js) return reply_serr(c, MSG_OUT_OF_MEMORY);
+
+    for (i = 0; i < n; i++) {
+        j = remove_reserved_job(c, job_find(ids[i]));
+        if (j) js[ct++] = j;
+    }
+
+    /* We want to update the delay deadlines on disk, so reserve space for
+     * that, all at once. */
+    if (delay && ct && !walresvupdaten(&c->srv->wal, js, ct)) {
+        /* give them back to this conn, still reserved */
+        for (i = 0; i < ct; i++) {
+            j = js[i];
+            global_stat.reserved_ct++;
+            j->tube->stat.reserved_ct++;
+            job_insert(&c->reserved_jobs, j);
+            /* can't fail; removing these jobs left room for them */
+            jobheapinsert(&c->deadlines, j, j->r.deadline_at);
+            j->reserver = c;
+        }
+        free(js);
+        return reply_serr(c, MSG_OUT_OF_MEMORY);
+    }
+
+    for (i = 0; i < ct; i++) {
+        j = js[i];
+        j->r.pri = pri;
+        j->r.delay = delay;
+        job_ct(j)->release_ct++;
+
+        r = enqueue_job(c->srv, j, delay, !!delay);
+
+        /* out of memory trying to grow the queue, so it gets buried */
+        if (r < 1) bury_job(c->srv, j, 0);
+    }
+
+    free(js);
+    reply_line(c, STATE_SENDWORD, MSG_RELEASED_BATCH_FMT, ct);
+}
+
+/* Start reading the body of a new job, whose size the caller has
+ * checked. */
+static void
+do_put(Conn *c, uint pri, int64 delay, int64 ttr, uint body_size)
+{
+    connsetproducer(c);
+
+    if (ttr < 1000000000) {
+        ttr = 1000000000;
+    }
+
+    c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
+
+    /* OOM? */
+    if (!c->in_job) {
+        /* throw away the job body and respond with OUT_OF_MEMORY */
+        return skip(c, c->binary ? body_size : body_size + 2,
+                    serr(BIN_OUT_OF_MEMORY));
+    }
+
+    /* a binary client doesn't send the "\r\n" */
+    if (c->binary) memcpy(c->in_job->body + body_size, "\r\n", 2);
+
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    maybe_enqueue_incoming_job(c);
+}
+
+/* Wait for a job for a reserve, or up to count jobs for a reserve-batch. */
+static void
+do_reserve(Conn *c, int count, int timeout)
+{
+    connsetworker(c);
+
+    if (conndeadlinesoon(c) && !conn_ready(c)) {
+        return reply_st(c, BIN_DEADLINE_SOON);
+    }
+
+    /* try to get some new jobs for this guy */
+    c->reserve_max = count;
+    if (!wait_for_job(c, timeout)) return reply_sterr(c, BIN_OUT_OF_MEMORY);
+    process_queue();
+}
+
 static void
-dispatch_cmd(Conn *c)
+do_peekjob(Conn *c, uint64 id)
+{
+    job j;
+
+    /* So, peek is annoying, because some other connection might free the
+     * job while we are still trying to write it out. So we copy it and
+     * then free the copy when it's done sending. */
+    j = job_copy(peek_job(id));
+
+    if (!j) return reply_st(c, BIN_NOT_FOUND);
+
+    reply_job(c, j, BIN_FOUND, MSG_FOUND);
+}
+
+/* The rest of these give back the status to reply with, and leave it to
+ * the caller to say it in the protocol c speaks. */
+
+static int
+do_delete(Conn *c, uint64 id)
+{
+    int r;
+    job j;
+
+    j = job_find(id);
+    j = remove_reserved_job(c, j) ? :
+        remove_ready_job(j) ? :
+        remove_buried_job(j) ? :
+        remove_delayed_job(j);
+
+    if (!j) return BIN_NOT_FOUND;
+
+    note_delete(j);
+    j->tube->stat.total_delete_ct++;
+
+    j->r.state = Invalid;
+    r = walwrite(&c->srv->wal, j);
+    job_free(j);
+
+    if (!r) return serr(BIN_INTERNAL_ERROR);
+
+    return BIN_DELETED;
+}
+
+static int
+do_release(Conn *c, uint64 id, uint pri, int64 delay)
+{
+    int r, z;
+    job j;
+
+    j = remove_reserved_job(c, job_find(id));
+
+    if (!j) return BIN_NOT_FOUND;
+
+    /* We want to update the delay deadline on disk, so reserve space for
+     * that. */
+    if (delay) {
+        z = walresvupdate(&c->srv->wal, j);
+        if (!z) return serr(BIN_OUT_OF_MEMORY);
+        j->walresv += z;
+    }
+
+    j->r.pri = pri;
+    j->r.delay = delay;
+    job_ct(j)->release_ct++;
+
+    r = enqueue_job(c->srv, j, delay, !!delay);
+    if (r < 0) return serr(BIN_INTERNAL_ERROR);
+    if (r == 1) return BIN_RELEASED;
+
+    /* out of memory trying to grow the queue, so it gets buried */
+    bury_job(c->srv, j, 0);
+    return BIN_BURIED;
+}
+
+static int
+do_bury(Conn *c, uint64 id, uint pri)
+{
+    job j;
+
+    j = remove_reserved_job(c, job_find(id));
+
+    if (!j) return BIN_NOT_FOUND;
+
+    j->r.pri = pri;
+    if (!bury_job(c->srv, j, 1)) return serr(BIN_INTERNAL_ERROR);
+    return BIN_BURIED;
+}
+
+static int
+do_jobkick(Conn *c, uint64 id)
+{
+    job j;
+
+    j = job_find(id);
+    if (!j) return BIN_NOT_FOUND;
+
+    if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
+        (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
+        return BIN_KICKED;
+    }
+    return BIN_NOT_FOUND;
+}
+
+static int
+do_touch(Conn *c, uint64 id)
+{
+    if (touch_job(c, job_find(id))) return BIN_TOUCHED;
+    return BIN_NOT_FOUND;
+}
+
+/* Name must be NUL-terminated in these three. On BIN_USING the tube is
+ * c->use; on BIN_WATCHING, c watches c->watch.used tubes. */
+static int
+do_use(Conn *c, char *name)
+{
+    tube t = NULL;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) return serr(BIN_OUT_OF_MEMORY);
+
+    c->use->using_ct--;
+    TUBE_ASSIGN(c->use, t);
+    TUBE_ASSIGN(t, NULL);
+    c->use->using_ct++;
+
+    return BIN_USING;
+}
+
+static int
+do_watch(Conn *c, char *name)
+{
+    int r = 1;
+    tube t = NULL;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t) return serr(BIN_OUT_OF_MEMORY);
+
+    if (!ms_contains(&c->watch, t)) r = ms_append(&c->watch, t);
+    TUBE_ASSIGN(t, NULL);
+    if (!r) return serr(BIN_OUT_OF_MEMORY);
+
+    return BIN_WATCHING;
+}
+
+static int
+do_ignore(Conn *c, char *name)
+{
+    size_t i;
+    tube t = NULL;
+
+    for (i = 0; i < c->watch.used; i++) {
+        t = c->watch.items[i];
+        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) break;
+        t = NULL;
+    }
+
+    if (t && c->watch.used < 2) return BIN_NOT_IGNORED;
+
+    if (t) ms_remove(&c->watch, t); /* may free t if refcount => 0 */
+
+    return BIN_WATCHING;
+}
+
+static void
+dispatch_cmd(Conn *c, byte type, char *p)
 {
     int r, i, timeout = -1;
     int z;
     uint count;
     job j = 0;
-    byte type;
-    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name;
+    char *end, *name;
     uint pri, body_size;
     int64 delay, ttr;
-    uint64 id;
+    uint64 id, *ids;
     tube t = NULL;
 
-    /* NUL-terminate this string so we can use strtol and friends */
-    c->cmd[c->cmd_len - 2] = '\0';
-
-    /* check for possible maliciousness */
-    if (strlen(c->cmd) != c->cmd_len - 2) {
-        return reply_msg(c, MSG_BAD_FORMAT);
-    }
-
-    type = which_cmd(c);
     if (verbose >= 2) {
         printf("<%d command %s\n", c->sock.fd, op_names[type]);
     }
 
     switch (type) {
     case OP_PUT:
-        r = read_pri(&pri, c->cmd + 4, &delay_buf);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_delay(&delay, delay_buf, &ttr_buf);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_ttr(&ttr, ttr_buf, &size_buf);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
-
-        errno = 0;
-        body_size = strtoul(size_buf, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_pri(&pri, &p) || read_delay(&delay, &p) ||
+            read_ttr(&ttr, &p) || read_pri(&body_size, &p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
         op_ct[type]++;
 
         if (body_size > job_data_size_limit) {
             /* throw away the job body and respond with JOB_TOO_BIG */
-            return skip(c, body_size + 2, MSG_JOB_TOO_BIG);
+            return skip(c, body_size + 2, BIN_JOB_TOO_BIG);
         }
 
         /* don't allow trailing garbage */
-        if (end_buf[0] != '\0') return reply_msg(c, MSG_BAD_FORMAT);
+        if (!at_eol(c, p)) return reply_msg(c, MSG_BAD_FORMAT);
 
+        do_put(c, pri, delay, ttr, body_size);
+        break;
+    case OP_PUT_BATCH:
+        if (read_pri(&pri, &p) || read_delay(&delay, &p) ||
+            read_ttr(&ttr, &p) || read_pri(&count, &p) || !at_eol(c, p) ||
+            count < 1 || count > MAX_BATCH) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+
+        op_ct[type]++;
         connsetproducer(c);
 
         if (ttr < 1000000000) {
             ttr = 1000000000;
         }
 
-        c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
-
-        /* OOM? */
-        if (!c->in_job) {
-            /* throw away the job body and respond with OUT_OF_MEMORY */
-            twarnx("server error: " MSG_OUT_OF_MEMORY);
-            return skip(c, body_size + 2, MSG_OUT_OF_MEMORY);
-        }
-
-        fill_extra_data(c);
-
-        /* it's possible we already have a complete job */
-        maybe_enqueue_incoming_job(c);
-
+        c->batch = calloc(count, sizeof(job));
+        if (!c->batch) return reply_serr(c, MSG_OUT_OF_MEMORY);
+        c->batch_ct = count;
+        c->batch_read = 0;
+        c->batch_err = NULL;
+        c->batch_id = job_reserve_ids(count);
+        c->batch_pri = pri;
+        c->batch_delay = delay;
+        c->batch_ttr = ttr;
+
+        /* the bodies follow, each after its own "<bytes>" line */
         break;
     case OP_PEEK_READY:
         /* don't allow trailing garbage */
@@ -1261,12 +2462,12 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->ready.len) {
-            j = job_copy(c->use->ready.data[0]);
+            j = job_copy(c->use->ready.data[0].j);
         }
 
         if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
 
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, BIN_FOUND, MSG_FOUND);
         break;
     case OP_PEEK_DELAYED:
         /* don't allow trailing garbage */
@@ -1276,12 +2477,12 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->delay.len) {
-            j = job_copy(c->use->delay.data[0]);
+            j = job_copy(c->use->delay.data[0].j);
         }
 
         if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
 
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, BIN_FOUND, MSG_FOUND);
         break;
     case OP_PEEK_BURIED:
         /* don't allow trailing garbage */
@@ -1294,27 +2495,19 @@ dispatch_cmd(Conn *c)
 
         if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
 
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, BIN_FOUND, MSG_FOUND);
         break;
     case OP_PEEKJOB:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_PEEKJOB_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
         op_ct[type]++;
-
-        /* So, peek is annoying, because some other connection might free the
-         * job while we are still trying to write it out. So we copy it and
-         * then free the copy when it's done sending. */
-        j = job_copy(peek_job(id));
-
-        if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-
-        reply_job(c, j, MSG_FOUND);
+        do_peekjob(c, id);
         break;
     case OP_RESERVE_TIMEOUT:
-        errno = 0;
-        timeout = strtol(c->cmd + CMD_RESERVE_TIMEOUT_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_timeout(&timeout, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
     case OP_RESERVE: /* FALLTHROUGH */
         /* don't allow trailing garbage */
         if (type == OP_RESERVE && c->cmd_len != CMD_RESERVE_LEN + 2) {
@@ -1322,141 +2515,102 @@ dispatch_cmd(Conn *c)
         }
 
         op_ct[type]++;
-        connsetworker(c);
-
-        if (conndeadlinesoon(c) && !conn_ready(c)) {
-            return reply_msg(c, MSG_DEADLINE_SOON);
-        }
-
-        /* try to get a new job for this guy */
-        wait_for_job(c, timeout);
-        process_queue();
+        do_reserve(c, 0, timeout);
+        break;
+    case OP_RESERVE_BATCH:
+        r = read_pri(&count, &p);
+        if (r || count < 1 || count > MAX_BATCH) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        if (!at_eol(c, p)) {
+            if (read_timeout(&timeout, &p) || !at_eol(c, p)) {
+                return reply_msg(c, MSG_BAD_FORMAT);
+            }
+        }
+
+        op_ct[type]++;
+        do_reserve(c, count, timeout);
         break;
     case OP_DELETE:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_DELETE_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
         op_ct[type]++;
-
-        j = job_find(id);
-        j = remove_reserved_job(c, j) ? :
-            remove_ready_job(j) ? :
-            remove_buried_job(j) ? :
-            remove_delayed_job(j);
-
-        if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-
-        j->tube->stat.total_delete_ct++;
-
-        j->r.state = Invalid;
-        r = walwrite(&c->srv->wal, j);
-        walmaint(&c->srv->wal);
-        job_free(j);
-
-        if (!r) return reply_serr(c, MSG_INTERNAL_ERROR);
-
-        reply(c, MSG_DELETED, MSG_DELETED_LEN, STATE_SENDWORD);
+        reply_st(c, do_delete(c, id));
         break;
     case OP_RELEASE:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_RELEASE_LEN, &pri_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_pri(&pri, pri_buf, &delay_buf);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_delay(&delay, delay_buf, NULL);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || read_pri(&pri, &p) ||
+            read_delay(&delay, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        op_ct[type]++;
+        reply_st(c, do_release(c, id, pri, delay));
+        break;
+    case OP_DELETE_BATCH:
+        z = read_ids(c, &ids, p);
+        if (z < 0) return reply_msg(c, MSG_BAD_FORMAT);
         op_ct[type]++;
 
-        j = remove_reserved_job(c, job_find(id));
-
-        if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-
-        /* We want to update the delay deadline on disk, so reserve space for
-         * that. */
-        if (delay) {
-            z = walresvupdate(&c->srv->wal, j);
-            if (!z) return reply_serr(c, MSG_OUT_OF_MEMORY);
-            j->walresv += z;
+        delete_batch(c, ids, z);
+        free(ids);
+        break;
+    case OP_RELEASE_BATCH:
+        if (read_pri(&pri, &p) || read_delay(&delay, &p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
         }
 
-        j->r.pri = pri;
-        j->r.delay = delay;
-        j->r.release_ct++;
+        z = read_ids(c, &ids, p);
+        if (z < 0) return reply_msg(c, MSG_BAD_FORMAT);
+        op_ct[type]++;
 
-        r = enqueue_job(c->srv, j, delay, !!delay);
-        if (r < 0) return reply_serr(c, MSG_INTERNAL_ERROR);
-        if (r == 1) {
-            return reply(c, MSG_RELEASED, MSG_RELEASED_LEN, STATE_SENDWORD);
-        }
+        release_batch(c, ids, z, pri, delay);
+        free(ids);
+        break;
+    case OP_TOUCH_BATCH:
+        z = read_ids(c, &ids, p);
+        if (z < 0) return reply_msg(c, MSG_BAD_FORMAT);
+        op_ct[type]++;
 
-        /* out of memory trying to grow the queue, so it gets buried */
-        bury_job(c->srv, j, 0);
-        reply(c, MSG_BURIED, MSG_BURIED_LEN, STATE_SENDWORD);
+        count = 0;
+        for (i = 0; i < z; i++) {
+            if (touch_job(c, job_find(ids[i]))) count++;
+        }
+        free(ids);
+        reply_line(c, STATE_SENDWORD, MSG_TOUCHED_BATCH_FMT, count);
         break;
     case OP_BURY:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_BURY_LEN, &pri_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_pri(&pri, pri_buf, NULL);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || read_pri(&pri, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
         op_ct[type]++;
-
-        j = remove_reserved_job(c, job_find(id));
-
-        if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-
-        j->r.pri = pri;
-        r = bury_job(c->srv, j, 1);
-        if (!r) return reply_serr(c, MSG_INTERNAL_ERROR);
-        reply(c, MSG_BURIED, MSG_BURIED_LEN, STATE_SENDWORD);
+        reply_st(c, do_bury(c, id, pri));
         break;
     case OP_KICK:
-        errno = 0;
-        count = strtoul(c->cmd + CMD_KICK_LEN, &end_buf, 10);
-        if (end_buf == c->cmd + CMD_KICK_LEN) {
+        if (read_pri(&count, &p) || !at_eol(c, p)) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
 
         op_ct[type]++;
 
-        i = kick_jobs(c->srv, c->use, count);
-
-        return reply_line(c, STATE_SENDWORD, "KICKED %u\r\n", i);
+        c->kick_left = count;
+        c->kick_ct = 0;
+        c->kick_buried = buried_job_p(c->use);
+        return kick_more(c);
     case OP_JOBKICK:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_JOBKICK_LEN, &end_buf, 10);
-        if (errno) return twarn("strtoull"), reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
         op_ct[type]++;
-
-        j = job_find(id);
-        if (!j) return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-
-        if ((j->r.state == Buried && kick_buried_job(c->srv, j)) ||
-            (j->r.state == Delayed && kick_delayed_job(c->srv, j))) {
-            reply(c, MSG_KICKED, MSG_KICKED_LEN, STATE_SENDWORD);
-        } else {
-            return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-        }
+        reply_st(c, do_jobkick(c, id));
         break;
     case OP_TOUCH:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_TOUCH_LEN, &end_buf, 10);
-        if (errno) return twarn("strtoull"), reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
         op_ct[type]++;
-
-        j = touch_job(c, job_find(id));
-
-        if (j) {
-            reply(c, MSG_TOUCHED, MSG_TOUCHED_LEN, STATE_SENDWORD);
-        } else {
-            return reply(c, MSG_NOTFOUND, MSG_NOTFOUND_LEN, STATE_SENDWORD);
-        }
+        reply_st(c, do_touch(c, id));
         break;
     case OP_STATS:
         /* don't allow trailing garbage */
@@ -1468,10 +2622,20 @@ dispatch_cmd(Conn *c)
 
         do_stats(c, fmt_stats, c->srv);
         break;
+    case OP_STATS_LATENCY:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_STATS_LATENCY_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+
+        op_ct[type]++;
+
+        do_stats(c, fmt_stats_latency, c->srv);
+        break;
     case OP_JOBSTATS:
-        errno = 0;
-        id = strtoull(c->cmd + CMD_JOBSTATS_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_id(&id, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
         op_ct[type]++;
 
@@ -1482,8 +2646,9 @@ dispatch_cmd(Conn *c)
         do_stats(c, (fmt_fn) fmt_job_stats, j);
         break;
     case OP_STATS_TUBE:
-        name = c->cmd + CMD_STATS_TUBE_LEN;
-        if (!name_is_ok(name, 200)) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_tube_name(&name, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
         op_ct[type]++;
 
@@ -1521,52 +2686,30 @@ dispatch_cmd(Conn *c)
         do_list_tubes(c, &c->watch);
         break;
     case OP_USE:
-        name = c->cmd + CMD_USE_LEN;
-        if (!name_is_ok(name, 200)) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_tube_name(&name, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
         op_ct[type]++;
-
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) return reply_serr(c, MSG_OUT_OF_MEMORY);
-
-        c->use->using_ct--;
-        TUBE_ASSIGN(c->use, t);
-        TUBE_ASSIGN(t, NULL);
-        c->use->using_ct++;
-
+        r = do_use(c, name);
+        if (r != BIN_USING) return reply_st(c, r);
         reply_line(c, STATE_SENDWORD, "USING %s\r\n", c->use->name);
         break;
     case OP_WATCH:
-        name = c->cmd + CMD_WATCH_LEN;
-        if (!name_is_ok(name, 200)) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_tube_name(&name, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
         op_ct[type]++;
-
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) return reply_serr(c, MSG_OUT_OF_MEMORY);
-
-        r = 1;
-        if (!ms_contains(&c->watch, t)) r = ms_append(&c->watch, t);
-        TUBE_ASSIGN(t, NULL);
-        if (!r) return reply_serr(c, MSG_OUT_OF_MEMORY);
-
+        r = do_watch(c, name);
+        if (r != BIN_WATCHING) return reply_st(c, r);
         reply_line(c, STATE_SENDWORD, "WATCHING %zu\r\n", c->watch.used);
         break;
     case OP_IGNORE:
-        name = c->cmd + CMD_IGNORE_LEN;
-        if (!name_is_ok(name, 200)) return reply_msg(c, MSG_BAD_FORMAT);
-        op_ct[type]++;
-
-        t = NULL;
-        for (i = 0; i < c->watch.used; i++) {
-            t = c->watch.items[i];
-            if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) break;
-            t = NULL;
+        if (read_tube_name(&name, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
         }
-
-        if (t && c->watch.used < 2) return reply_msg(c, MSG_NOT_IGNORED);
-
-        if (t) ms_remove(&c->watch, t); /* may free t if refcount => 0 */
-        t = NULL;
-
+        op_ct[type]++;
+        r = do_ignore(c, name);
+        if (r != BIN_WATCHING) return reply_st(c, r);
         reply_line(c, STATE_SENDWORD, "WATCHING %zu\r\n", c->watch.used);
         break;
     case OP_QUIT:
@@ -1575,14 +2718,13 @@ dispatch_cmd(Conn *c)
     case OP_PAUSE_TUBE:
         op_ct[type]++;
 
-        r = read_tube_name(&name, c->cmd + CMD_PAUSE_TUBE_LEN, &delay_buf);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
-
-        r = read_delay(&delay, delay_buf, NULL);
-        if (r) return reply_msg(c, MSG_BAD_FORMAT);
+        if (read_tube_name(&name, &p)) return reply_msg(c, MSG_BAD_FORMAT);
+        end = p;
+        if (read_delay(&delay, &p) || !at_eol(c, p)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
 
-        *delay_buf = '\0';
-        if (!name_is_ok(name, 200)) return reply_msg(c, MSG_BAD_FORMAT);
+        *end = '\0';
         t = tube_find(name);
         if (!t) return reply_msg(c, MSG_NOTFOUND);
 
@@ -1595,6 +2737,7 @@ dispatch_cmd(Conn *c)
         t->deadline_at = nanoseconds() + delay;
         t->pause = delay;
         t->stat.pause_ct++;
+        update_ready_tube(t);
 
         reply_line(c, STATE_SENDWORD, "PAUSED\r\n");
         break;
@@ -1603,6 +2746,108 @@ dispatch_cmd(Conn *c)
     }
 }
 
+/* Read the tube name of n bytes after the binary header at c->cmd into
+ * name, NUL-terminated. Returns 0 on success, or -1 if it is not a name. */
+static int
+read_bin_name(Conn *c, char *name, uint32 n)
+{
+    if (n == 0 || n > MAX_TUBE_NAME_LEN - 1) return -1;
+    memcpy(name, c->cmd + BIN_HDR_SIZE, n);
+    name[n] = '\0';
+    if (strspn(name, NAME_CHARS) != n || name[0] == '-') return -1;
+    return 0;
+}
+
+/* Handle the binary frame at c->cmd. Its fields, laid out above
+ * BIN_HDR_SIZE, are the arguments that the text command would have,
+ * and it does the same thing; only the most used commands have binary
+ * forms. A binary client gets binary replies throughout. */
+static void
+dispatch_bin(Conn *c, byte type)
+{
+    char *h = c->cmd, name[MAX_TUBE_NAME_LEN];
+    uint32 pri, delay, ttr, len;
+    uint64 id;
+    byte st;
+
+    if ((byte)h[0] != BIN_MAGIC) {
+        /* lost our place in the stream; nothing after this makes sense */
+        twarnx("bad binary frame from fd %d", c->sock.fd);
+        c->state = STATE_CLOSE;
+        return;
+    }
+    pri = getle32(h + 4);
+    id = getle64(h + 8);
+    delay = getle32(h + 16);
+    ttr = getle32(h + 20);
+    len = getle32(h + 24);
+
+    if (verbose >= 2) {
+        printf("<%d binary command %s\n", c->sock.fd, op_names[type]);
+    }
+
+    /* bin_len has left out the payload if it's too long to be a name */
+    if (type != OP_PUT && len > MAX_TUBE_NAME_LEN - 1) {
+        return skip(c, len, BIN_BAD_FORMAT);
+    }
+
+    switch (type) {
+    case OP_PUT:
+        op_ct[type]++;
+        if (len > job_data_size_limit) return skip(c, len, BIN_JOB_TOO_BIG);
+        return do_put(c, pri, delay * 1000000000LL, ttr * 1000000000LL, len);
+    case OP_RESERVE:
+    case OP_RESERVE_TIMEOUT:
+        if (len || delay > INT32_MAX) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return do_reserve(c, 0, type == OP_RESERVE ? -1 : (int)delay);
+    case OP_DELETE:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_delete(c, id));
+    case OP_RELEASE:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_release(c, id, pri, delay * 1000000000LL));
+    case OP_BURY:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_bury(c, id, pri));
+    case OP_TOUCH:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_touch(c, id));
+    case OP_PEEKJOB:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return do_peekjob(c, id);
+    case OP_JOBKICK:
+        if (len) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_jobkick(c, id));
+    case OP_USE:
+        if (read_bin_name(c, name, len)) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        return reply_st(c, do_use(c, name));
+    case OP_WATCH:
+        if (read_bin_name(c, name, len)) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        st = do_watch(c, name);
+        if (st != BIN_WATCHING) return reply_st(c, st);
+        return reply_bin(c, STATE_SENDWORD, st, 0, c->watch.used, 0);
+    case OP_IGNORE:
+        if (read_bin_name(c, name, len)) return reply_st(c, BIN_BAD_FORMAT);
+        op_ct[type]++;
+        st = do_ignore(c, name);
+        if (st != BIN_WATCHING) return reply_st(c, st);
+        return reply_bin(c, STATE_SENDWORD, st, 0, c->watch.used, 0);
+    case OP_QUIT:
+        c->state = STATE_CLOSE;
+        return;
+    }
+    reply_st(c, BIN_UNKNOWN_COMMAND);
+}
+
 /* There are three reasons this function may be called. We need to check for
  * all of them.
  *
@@ -1617,6 +2862,8 @@ conn_timeout(Conn *c)
     int r, should_timeout = 0;
     job j;
 
+    if (c->state == STATE_KICK) kick_more(c);
+
     /* Check if the client was trying to reserve a job. */
     if (conn_waiting(c) && conndeadlinesoon(c)) should_timeout = 1;
 
@@ -1634,17 +2881,17 @@ conn_timeout(Conn *c)
         }
 
         timeout_ct++; /* stats */
-        j->r.timeout_ct++;
+        job_ct(j)->timeout_ct++;
         r = enqueue_job(c->srv, remove_this_reserved_job(c, j), 0, 0);
         if (r < 1) bury_job(c->srv, j, 0); /* out of memory, so bury it */
         connsched(c);
     }
 
     if (should_timeout) {
-        return reply_msg(remove_waiting_conn(c), MSG_DEADLINE_SOON);
+        return reply_st(remove_waiting_conn(c), BIN_DEADLINE_SOON);
     } else if (conn_waiting(c) && c->pending_timeout >= 0) {
         c->pending_timeout = -1;
-        return reply_msg(remove_waiting_conn(c), MSG_TIMED_OUT);
+        return reply_st(remove_waiting_conn(c), BIN_TIMED_OUT);
     }
 }
 
@@ -1654,19 +2901,73 @@ enter_drain_mode(int sig)
     drain_mode = 1;
 }
 
+/* The batch commands that take a list of job ids may have a command line
+ * longer than LINE_BUF_SIZE. If c->cmd is full and holds the start of one,
+ * move it to a buffer of BATCH_LINE_SIZE bytes. Return 1 on success. */
+static int
+grow_cmd(Conn *c)
+{
+    char *buf;
+
+    if (c->cmd != c->cmd_buf) return 0;
+    if (!c->binary && /* a long tube name might not fit */
+        strncmp(c->cmd, CMD_DELETE_BATCH, CMD_DELETE_BATCH_LEN) &&
+        strncmp(c->cmd, CMD_RELEASE_BATCH, CMD_RELEASE_BATCH_LEN) &&
+        strncmp(c->cmd, CMD_TOUCH_BATCH, CMD_TOUCH_BATCH_LEN)) return 0;
+
+    buf = malloc(BATCH_LINE_SIZE);
+    if (!buf) return 0;
+    memcpy(buf, c->cmd, c->cmd_read);
+    c->cmd = buf;
+    c->cmd_size = BATCH_LINE_SIZE;
+    return 1;
+}
+
+/* Go back to the small command buffer once what is left fits in it. */
+static void
+shrink_cmd(Conn *c)
+{
+    if (c->cmd == c->cmd_buf || c->cmd_read > LINE_BUF_SIZE) return;
+    memcpy(c->cmd_buf, c->cmd, c->cmd_read);
+    free(c->cmd);
+    c->cmd = c->cmd_buf;
+    c->cmd_size = LINE_BUF_SIZE;
+}
+
 static void
 do_cmd(Conn *c)
 {
-    dispatch_cmd(c);
+    byte type;
+    char *args;
+    int64 t;
+
+    if (c->batch) {
+        batch_line(c);
+    } else if (c->binary) {
+        t = nanoseconds();
+        type = (byte)c->cmd[1] < TOTAL_OPS ? c->cmd[1] : OP_UNKNOWN;
+        dispatch_bin(c, type);
+        histadd(&op_hist[type], nanoseconds() - t);
+    } else {
+        t = nanoseconds();
+
+        /* NUL-terminate this string so the parsers can stop at its end;
+         * at_eol tells that apart from a NUL sent by the client */
+        c->cmd[c->cmd_len - 2] = '\0';
+
+        type = which_cmd(c, &args);
+        dispatch_cmd(c, type, args);
+        histadd(&op_hist[type], nanoseconds() - t);
+    }
     fill_extra_data(c);
+    shrink_cmd(c);
 }
 
 static void
 reset_conn(Conn *c)
 {
     connwant(c, 'r');
-    c->next = dirty;
-    dirty = c;
+    mark_dirty(c);
 
     /* was this a peek or stats command? */
     if (c->out_job && c->out_job->r.state == Copy) job_free(c->out_job);
@@ -1685,7 +2986,7 @@ conn_data(Conn *c)
 
     switch (c->state) {
     case STATE_WANTCOMMAND:
-        r = read(c->sock.fd, c->cmd + c->cmd_read, LINE_BUF_SIZE - c->cmd_read);
+        r = read(c->sock.fd, c->cmd + c->cmd_read, c->cmd_size - c->cmd_read);
         if (r == -1) return check_err(c, "read()");
         if (r == 0) {
             c->state = STATE_CLOSE;
@@ -1699,12 +3000,12 @@ conn_data(Conn *c)
         /* yay, complete command line */
         if (c->cmd_len) return do_cmd(c);
 
-        /* c->cmd_read > LINE_BUF_SIZE can't happen */
+        /* c->cmd_read > c->cmd_size can't happen */
 
         /* command line too long? */
-        if (c->cmd_read == LINE_BUF_SIZE) {
+        if (c->cmd_read == c->cmd_size && !grow_cmd(c)) {
             c->cmd_read = 0; /* discard the input so far */
-            return reply_msg(c, MSG_BAD_FORMAT);
+            return reply_st(c, BIN_BAD_FORMAT);
         }
 
         /* otherwise we have an incomplete line, so just keep waiting */
@@ -1725,13 +3026,14 @@ conn_data(Conn *c)
         /* (c->in_job_read < 0) can't happen */
 
         if (c->in_job_read == 0) {
+            if (c->batch) return batch_next(c);
             return reply(c, c->reply, c->reply_len, STATE_SENDWORD);
         }
         break;
     case STATE_WANTDATA:
         j = c->in_job;
 
-        r = read(c->sock.fd, j->body + c->in_job_read, j->r.body_size -c->in_job_read);
+        r = read(c->sock.fd, j->body + c->in_job_read, wire_size(c, j) - c->in_job_read);
         if (r == -1) return check_err(c, "read()");
         if (r == 0) {
             c->state = STATE_CLOSE;
@@ -1745,6 +3047,7 @@ conn_data(Conn *c)
         maybe_enqueue_incoming_job(c);
         break;
     case STATE_SENDWORD:
+        if (hold(c)) return;
         r= write(c->sock.fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent);
         if (r == -1) return check_err(c, "write()");
         if (r == 0) {
@@ -1761,15 +3064,28 @@ conn_data(Conn *c)
         /* otherwise we sent an incomplete reply, so just keep waiting */
         break;
     case STATE_SENDJOB:
+        if (hold(c)) return;
         j = c->out_job;
 
-        iov[0].iov_base = (void *)(c->reply + c->reply_sent);
-        iov[0].iov_len = c->reply_len - c->reply_sent; /* maybe 0 */
-        iov[1].iov_base = j->body + c->out_job_sent;
-        iov[1].iov_len = j->r.body_size - c->out_job_sent;
+        if (!j->body) {
+            /* the body is only in the wal; send it straight from there */
+            if (c->reply_sent < c->reply_len) {
+                r = write(c->sock.fd, c->reply + c->reply_sent,
+                          c->reply_len - c->reply_sent);
+            } else if ((r = filerfd(j->file)) > -1) {
+                r = rawsendfile(c->sock.fd, r, j->body_off + c->out_job_sent,
+                                wire_size(c, j) - c->out_job_sent);
+            }
+            if (r == -1) return check_err(c, "sendfile()");
+        } else {
+            iov[0].iov_base = (void *)(c->reply + c->reply_sent);
+            iov[0].iov_len = c->reply_len - c->reply_sent; /* maybe 0 */
+            iov[1].iov_base = j->body + c->out_job_sent;
+            iov[1].iov_len = wire_size(c, j) - c->out_job_sent;
 
-        r = writev(c->sock.fd, iov, 2);
-        if (r == -1) return check_err(c, "writev()");
+            r = writev(c->sock.fd, iov, 2);
+            if (r == -1) return check_err(c, "writev()");
+        }
         if (r == 0) {
             c->state = STATE_CLOSE;
             return;
@@ -1782,10 +3098,10 @@ conn_data(Conn *c)
             c->reply_sent = c->reply_len;
         }
 
-        /* (c->out_job_sent > j->r.body_size) can't happen */
+        /* (c->out_job_sent > wire_size(c, j)) can't happen */
 
         /* are we done? */
-        if (c->out_job_sent == j->r.body_size) {
+        if (c->out_job_sent == wire_size(c, j)) {
             if (verbose >= 2) {
                 printf(">%d job %"PRIu64"\n", c->sock.fd, j->r.id);
             }
@@ -1797,7 +3113,7 @@ conn_data(Conn *c)
     case STATE_WAIT:
         if (c->halfclosed) {
             c->pending_timeout = -1;
-            return reply_msg(remove_waiting_conn(c), MSG_TIMED_OUT);
+            return reply_st(remove_waiting_conn(c), BIN_TIMED_OUT);
         }
         break;
     }
@@ -1816,20 +3132,142 @@ update_conns()
         c = dirty;
         dirty = dirty->next;
         c->next = NULL;
+        c->dirty = 0;
         r = sockwant(&c->sock, c->rw);
         if (r == -1) {
             twarn("sockwant");
+            protrmheld(c);
             connclose(c);
         }
     }
 }
 
+/* What c wants from its socket, given its state, once any held-back
+ * replies have gone out. */
+static int
+state_want(Conn *c)
+{
+    switch (c->state) {
+    case STATE_SENDWORD:
+    case STATE_SENDJOB:
+        return 'w';
+    case STATE_WAIT:
+    case STATE_KICK:
+        return 'h';
+    }
+    return 'r';
+}
+
+/* If c has a complete reply to send, move it into c->out_buf instead and
+ * get ready for the next command. Replies that are partly sent or do not
+ * fit are left alone; they follow the buffer out. */
+static void
+conn_coalesce(Conn *c)
+{
+    int n;
+    job j = c->out_job;
+
+    if (c->reply_sent) return;
+    switch (c->state) {
+    case STATE_SENDWORD:
+        n = c->reply_len;
+        break;
+    case STATE_SENDJOB:
+        if (c->out_job_sent || !j->body) return;
+        n = c->reply_len + wire_size(c, j);
+        break;
+    default:
+        return;
+    }
+
+    if (c->out_len + n > OUT_BUF_SIZE) return;
+    if (!c->out_buf) {
+        c->out_buf = malloc(OUT_BUF_SIZE);
+        if (!c->out_buf) return;
+    }
+
+    memcpy(c->out_buf + c->out_len, c->reply, c->reply_len);
+    c->out_len += c->reply_len;
+    if (c->state == STATE_SENDJOB) {
+        memcpy(c->out_buf + c->out_len, j->body, wire_size(c, j));
+        c->out_len += wire_size(c, j);
+        if (verbose >= 2) {
+            printf(">%d job %"PRIu64"\n", c->sock.fd, j->r.id);
+        }
+    }
+    reset_conn(c);
+}
+
+/* Write out the replies held in c->out_buf. */
+static void
+conn_flush(Conn *c)
+{
+    int r;
+
+    if (hold(c)) return;
+    r = write(c->sock.fd, c->out_buf + c->out_sent, c->out_len - c->out_sent);
+    if (r == -1) return check_err(c, "write()");
+    if (r == 0) {
+        c->state = STATE_CLOSE;
+        return;
+    }
+
+    c->out_sent += r;
+    if (c->out_sent < c->out_len) return;
+
+    c->out_len = c->out_sent = 0;
+    connwant(c, state_want(c));
+    mark_dirty(c);
+}
+
+#define want_input(c) ((c)->state == STATE_WANTCOMMAND || \
+                       (c)->state == STATE_WANTDATA || \
+                       (c)->state == STATE_BITBUCKET)
+
+/* Handle every complete command c has sent, reading more for as long as
+ * the client keeps sending, and collect the replies in c->out_buf. */
+static void
+conn_pipeline(Conn *c)
+{
+    int state, n;
+
+    for (;;) {
+        conn_coalesce(c);
+        while (cmd_data_ready(c) && (c->cmd_len = cmd_len(c))) {
+            do_cmd(c);
+            conn_coalesce(c);
+        }
+        if (!c->out_len || !want_input(c)) break;
+
+        /* stop once a read makes no progress */
+        state = c->state;
+        n = c->cmd_read + c->in_job_read;
+        conn_data(c);
+        if (c->state == state && c->cmd_read + c->in_job_read == n) break;
+    }
+
+    if (c->state == STATE_CLOSE) {
+        /* the client hung up; send what we can before closing */
+        if (c->out_len) {
+            walflush(&c->srv->wal);
+            conn_flush(c);
+        }
+        return;
+    }
+
+    if (c->out_len) {
+        connwant(c, 'w');
+        mark_dirty(c);
+    }
+}
+
 static void
 h_conn(const int fd, const short which, Conn *c)
 {
     if (fd != c->sock.fd) {
         twarnx("Argh! event fd doesn't match conn fd.");
         close(fd);
+        protrmheld(c);
         connclose(c);
         update_conns();
         return;
@@ -1839,10 +3277,15 @@ h_conn(const int fd, const short which, Conn *c)
         c->halfclosed = 1;
     }
 
-    conn_data(c);
-    while (cmd_data_ready(c) && (c->cmd_len = cmd_len(c))) do_cmd(c);
+    if (c->out_len) {
+        conn_flush(c);
+    } else {
+        conn_data(c);
+        conn_pipeline(c);
+    }
     if (c->state == STATE_CLOSE) {
         protrmdirty(c);
+        protrmheld(c);
         connclose(c);
     }
     update_conns();
@@ -1854,6 +3297,24 @@ prothandle(Conn *c, int ev)
     h_conn(c->sock.fd, ev, c);
 }
 
+/* Send the replies held back by hold. The server calls this once a
+ * pass, right after walflush. A conn that goes on to handle more
+ * commands here gets its replies held for the next pass. */
+void
+protflush(Server *s)
+{
+    Conn *c;
+
+    flushing = held;
+    held = NULL;
+    while ((c = flushing)) {
+        flushing = c->hnext;
+        c->hnext = NULL;
+        c->held = 0;
+        h_conn(c->sock.fd, 'w', c);
+    }
+}
+
 int64
 prottick(Server *s)
 {
@@ -1882,6 +3343,7 @@ prottick(Server *s)
         d = t->deadline_at - now;
         if (t->pause && d <= 0) {
             t->pause = 0;
+            update_ready_tube(t);
             process_queue();
         }
         else if (d > 0) {
@@ -1906,71 +3368,47 @@ prottick(Server *s)
     return period;
 }
 
+// H_accept takes every connection waiting on listening socket fd,
+// so a burst of reconnects costs one readiness event, not one each.
 void
 h_accept(const int fd, const short which, Server *s)
 {
     Conn *c;
-    int cfd, flags, r;
-    socklen_t addrlen;
-    struct sockaddr_in6 addr;
-
-    addrlen = sizeof addr;
-    cfd = accept(fd, (struct sockaddr *)&addr, &addrlen);
-    if (cfd == -1) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) twarn("accept()");
-        update_conns();
-        return;
-    }
-    if (verbose) {
-        printf("accept %d\n", cfd);
-    }
+    int cfd, r;
 
-    flags = fcntl(cfd, F_GETFL, 0);
-    if (flags < 0) {
-        twarn("getting flags");
-        close(cfd);
-        if (verbose) {
-            printf("close %d\n", cfd);
+    for (;;) {
+        cfd = rawaccept(fd);
+        if (cfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) twarn("accept()");
+            break;
         }
-        update_conns();
-        return;
-    }
-
-    r = fcntl(cfd, F_SETFL, flags | O_NONBLOCK);
-    if (r < 0) {
-        twarn("setting O_NONBLOCK");
-        close(cfd);
         if (verbose) {
-            printf("close %d\n", cfd);
+            printf("accept %d\n", cfd);
         }
-        update_conns();
-        return;
-    }
 
-    c = make_conn(cfd, STATE_WANTCOMMAND, default_tube, default_tube);
-    if (!c) {
-        twarnx("make_conn() failed");
-        close(cfd);
-        if (verbose) {
-            printf("close %d\n", cfd);
+        c = make_conn(cfd, STATE_WANTCOMMAND, default_tube, default_tube);
+        if (!c) {
+            twarnx("make_conn() failed");
+            close(cfd);
+            if (verbose) {
+                printf("close %d\n", cfd);
+            }
+            continue;
         }
-        update_conns();
-        return;
-    }
-    c->srv = s;
-    c->sock.x = c;
-    c->sock.f = (Handle)prothandle;
-    c->sock.fd = cfd;
+        c->srv = s;
+        c->sock.x = c;
+        c->sock.f = (Handle)prothandle;
+        c->sock.fd = cfd;
 
-    r = sockwant(&c->sock, 'r');
-    if (r == -1) {
-        twarn("sockwant");
-        close(cfd);
-        if (verbose) {
-            printf("close %d\n", cfd);
+        r = sockwant(&c->sock, 'r');
+        if (r == -1) {
+            twarn("sockwant");
+            close(cfd);
+            if (verbose) {
+                printf("close %d\n", cfd);
+            }
+            continue;
         }
-        update_conns();
-        return;
     }
     update_conns();
 }
@@ -2005,6 +3443,10 @@ prot_init()
     }
 
     ms_init(&tubes, NULL, NULL);
+    ready_tubes.less = (Less)ready_tube_less;
+    ready_tubes.rec = (Record)ready_tube_rec;
+    delay_tubes.less = (Less)delay_tube_less;
+    delay_tubes.rec = (Record)delay_tube_rec;
 
     TUBE_ASSIGN(default_tube, tube_find_or_make("default"));
     if (!default_tube) twarnx("Out of memory during startup!");
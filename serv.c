@@ -18,7 +18,7 @@ srvserve(Server *s)
 {
     int r;
     Socket *sock;
-    int64 period;
+    int64 period, wait, t;
 
     if (sockinit() == -1) {
         twarnx("sockinit");
@@ -44,17 +44,28 @@ srvserve(Server *s)
 
 
     for (;;) {
+        t = nanoseconds();
         period = prottick(s);
+        wait = walmaint(&s->wal);
+        if (wait) period = min(period, wait);
+        walflush(&s->wal);
+        protflush(s);
+        histadd(&s->tickhist, nanoseconds() - t);
 
-        int rw = socknext(&sock, period);
-        if (rw == -1) {
-            twarnx("socknext");
-            exit(1);
-        }
+        // Handle every event of one batch before ticking again.
+        do {
+            int rw = socknext(&sock, period);
+            if (rw == -1) {
+                twarnx("socknext");
+                exit(1);
+            }
 
-        if (rw) {
-            sock->f(sock->x, rw);
-        }
+            if (rw) {
+                t = nanoseconds();
+                sock->f(sock->x, rw);
+                histadd(&s->eventhist, nanoseconds() - t);
+            }
+        } while (sockpending());
     }
 }
 
@@ -0,0 +1,349 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "dat.h"
+
+// A snapshot holds every live job in the log, as of some point in
+// it, so that recovery can load the snapshot and replay only the
+// records written after that point (see walread). The log itself
+// is unchanged; the snapshot only saves reading it.
+//
+// The file is:
+//
+//   Snaphdr
+//   for each job, ordered by the log file holding its full record:
+//     int namelen; tube name; Walrec; Snaprec; body, if Snaprec.inbody
+//   int -1; uint64 number of jobs
+//
+// Bodies kept only in the log (see -B and -S) stay there, so they
+// aren't read back just to be copied.
+
+enum
+{
+    Snapver = 1,
+};
+
+typedef struct Snaphdr Snaphdr;
+typedef struct Snaprec Snaprec;
+
+struct Snaphdr {
+    int ver;
+    int walver; // the layout of Walrec
+    int seq;    // the snapshot covers records up to offset off
+    int off;    // in binlog.seq
+};
+
+struct Snaprec {
+    int seq;      // file holding the job's full record
+    int body_off; // where in that file its body is
+    int walused;
+    int inbody;   // does the body follow?
+};
+
+
+static char *
+snappath(Wal *w, char *name)
+{
+    return fmtalloc("%s/%s", w->dir, name);
+}
+
+
+static int
+put(FILE *fp, void *p, size_t n)
+{
+    return fwrite(p, 1, n, fp) == n;
+}
+
+
+// Snapwrite writes a snapshot of the jobs in w to w->dir/snapshot.
+// The new snapshot replaces the old one only once it is complete
+// and synced, so a crash leaves one or the other.
+// It returns 1 on success, 0 on error.
+static int
+snapwrite(Wal *w)
+{
+    char *path, *tmp;
+    FILE *fp = NULL;
+    File *f;
+    job j;
+    int r = 0, nl, end = -1;
+    uint64 n = 0;
+    Snaphdr h = {Snapver, Walver};
+    Snaprec sr;
+    Walrec wr;
+
+    // the snapshot picks up where the log on disk leaves off
+    h.seq = w->cur->seq;
+    h.off = w->cur->wpos;
+
+    path = snappath(w, "snapshot");
+    tmp = snappath(w, "snapshot.tmp");
+    if (!path || !tmp) {
+        twarnx("OOM");
+        goto done;
+    }
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        twarn("open %s", tmp);
+        goto done;
+    }
+
+    if (!put(fp, &h, sizeof h)) goto fail;
+    for (f = w->head; f; f = f->next) {
+        for (j = f->jlist.fnext; j && j != &f->jlist; j = j->fnext) {
+            towal(&wr, j);
+            nl = strlen(j->tube->name);
+            sr.seq = f->seq;
+            sr.body_off = j->body_off;
+            sr.walused = j->walused;
+            sr.inbody = !!j->body;
+            if (!(put(fp, &nl, sizeof nl) &&
+                  put(fp, j->tube->name, nl) &&
+                  put(fp, &wr, sizeof wr) &&
+                  put(fp, &sr, sizeof sr) &&
+                  (!sr.inbody || put(fp, j->body, j->r.body_size)))) {
+                goto fail;
+            }
+            n++;
+        }
+    }
+    if (!put(fp, &end, sizeof end) || !put(fp, &n, sizeof n)) goto fail;
+    if (fflush(fp) || fsync(fileno(fp))) goto fail;
+    if (fclose(fp)) {
+        fp = NULL;
+        goto fail;
+    }
+    fp = NULL;
+    if (rename(tmp, path)) goto fail;
+    r = 1;
+    goto done;
+
+fail:
+    twarn("write %s", tmp);
+    unlink(tmp);
+done:
+    if (fp) fclose(fp);
+    free(path);
+    free(tmp);
+    return r;
+}
+
+
+// Snapstart starts writing a snapshot of w in a child process.
+// The child has its own copy of the server's memory as of now, so
+// the server goes on serving while the snapshot is written and
+// synced, however much live data there is. Only one snapshot is
+// written at a time. Returns 1 if one was started.
+int
+snapstart(Wal *w)
+{
+    pid_t pid;
+
+    if (w->snappid) return 0;
+
+    // the child's snapshot picks up where the log on disk leaves off
+    if (!filewflush(w->cur)) {
+        filewclose(w->cur);
+        w->use = 0;
+        return 0;
+    }
+    pid = fork();
+    if (pid == -1) {
+        twarn("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        _exit(snapwrite(w) ? 0 : 1);
+    }
+    w->snappid = pid;
+    return 1;
+}
+
+
+// Snapdone checks on the snapshot started by snapstart, without
+// waiting for it. Returns 1 once it has replaced the old one.
+int
+snapdone(Wal *w)
+{
+    int st;
+    pid_t r;
+
+    r = waitpid(w->snappid, &st, WNOHANG);
+    if (r == 0) return 0;
+    w->snappid = 0;
+    if (r == -1) {
+        twarn("waitpid");
+        return 0;
+    }
+    if (WIFEXITED(st) && WEXITSTATUS(st) == 0) return 1;
+    twarnx("snapshot failed");
+    return 0;
+}
+
+
+// Take returns the next n bytes of s, or NULL if there aren't that many.
+static char *
+take(Snap *s, int n)
+{
+    char *p = s->map + s->pos;
+
+    if (n < 0 || s->len - s->pos < n) return NULL;
+    s->pos += n;
+    return p;
+}
+
+
+// Get copies the next n bytes of s into p, since records
+// in the mapping aren't aligned. Returns 1 on success.
+static int
+get(Snap *s, void *p, int n)
+{
+    char *q = take(s, n);
+
+    if (!q) return 0;
+    memcpy(p, q, n);
+    return 1;
+}
+
+
+// Snapcheck reads through s, checking each record without acting on it,
+// and leaves s->pos at the first record.
+// Returns 1 if s is good, or 0 if not.
+static int
+snapcheck(Snap *s)
+{
+    int nl;
+    Walrec wr;
+    Snaprec sr;
+    uint64 n = 0, ct;
+
+    for (;;) {
+        if (!get(s, &nl, sizeof nl)) return 0;
+        if (nl == -1) break;
+        if (nl >= MAX_TUBE_NAME_LEN || !take(s, nl)) return 0;
+        if (!get(s, &wr, sizeof wr) || !get(s, &sr, sizeof sr)) return 0;
+        if (!wr.id || wr.body_size < 0) return 0;
+        if (wr.body_size > job_data_size_limit) return 0;
+        if (sr.inbody && !take(s, wr.body_size)) return 0;
+        n++;
+    }
+    if (!get(s, &ct, sizeof ct) || ct != n || s->pos != s->len) return 0;
+    s->pos = sizeof(Snaphdr);
+    return 1;
+}
+
+
+// Snapopen maps w->dir/snapshot into s and checks it, setting s->seq
+// and s->off to where in the log it leaves off.
+// Returns 1 on success, or 0 if there is no usable snapshot.
+int
+snapopen(Snap *s, Wal *w)
+{
+    int fd;
+    char *path;
+    struct stat st;
+    Snaphdr h;
+
+    memset(s, 0, sizeof *s);
+    path = snappath(w, "snapshot");
+    if (!path) return 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(path);
+        return 0;
+    }
+    if (fstat(fd, &st) || st.st_size < sizeof h) goto bad;
+    s->len = st.st_size;
+    s->map = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        goto bad;
+    }
+    (void)madvise(s->map, s->len, MADV_SEQUENTIAL);
+    memcpy(&h, s->map, sizeof h);
+    s->pos = sizeof h;
+    if (h.ver != Snapver || h.walver != Walver || !snapcheck(s)) goto bad;
+    s->seq = h.seq;
+    s->off = h.off;
+    close(fd);
+    free(path);
+    return 1;
+
+bad:
+    warnx("%s: ignoring bad snapshot", path);
+    close(fd);
+    free(path);
+    snapclose(s);
+    return 0;
+}
+
+
+// Snapload puts the jobs in s into list, each attached to its file
+// in w. A job is left out if its file is gone, since then a later
+// record in the log either moved the job to a newer file or
+// deleted it; replaying the log after s->off takes care of both.
+void
+snapload(Snap *s, Wal *w, job list)
+{
+    int nl;
+    char *name, *body, tubename[MAX_TUBE_NAME_LEN];
+    Walrec wr;
+    Snaprec sr;
+    File *f = w->head;
+    job j;
+    tube t;
+
+    // snapcheck has made sure all of these succeed
+    while (get(s, &nl, sizeof nl) && nl != -1) {
+        name = take(s, nl);
+        get(s, &wr, sizeof wr);
+        get(s, &sr, sizeof sr);
+        body = sr.inbody ? take(s, wr.body_size) : NULL;
+
+        while (f && f->seq < sr.seq) f = f->next;
+        if (!f || f->seq != sr.seq) continue;
+
+        memcpy(tubename, name, nl);
+        tubename[nl] = '\0';
+        t = tube_find_or_make(tubename);
+        j = make_job_with_id(wr.pri, wr.delay, wr.ttr, wr.body_size,
+                             t, wr.id);
+        if (!j) exit(1); // make_job_with_id has complained
+        fromwal(j, &wr);
+        if (j->r.state == Reserved) j->r.state = Ready;
+        j->body_off = sr.body_off;
+        fileaddjob(f, j);
+        j->walused = sr.walused;
+        w->alive += sr.walused;
+
+        // under -B, big bodies stay on disk, like those left out of s
+        if (!body || (w->bigbody && j->r.body_size >= w->bigbody)) {
+            job_dropbody(j);
+        }
+        if (j->body && body) {
+            memcpy(j->body, body, j->r.body_size);
+        } else if (j->body &&
+                   !filepread(f, j->body, j->r.body_size, j->body_off)) {
+            twarnx("job %"PRIu64": can't read body", j->r.id);
+            filermjob(f, j);
+            job_free(j);
+            continue;
+        }
+        job_insert(list, j);
+    }
+}
+
+
+void
+snapclose(Snap *s)
+{
+    if (s->map) munmap(s->map, s->len);
+    s->map = NULL;
+}
@@ -25,6 +25,31 @@ cttestheap_insert_one()
 }
 
 
+void
+cttestheap_grow()
+{
+    Heap h = {0};
+    void **data;
+    job j;
+    int i;
+
+    h.less = job_pri_less;
+    h.rec = job_setheappos;
+
+    assertf(heapgrow(&h, 10), "heapgrow");
+    assertf(h.cap >= 10, "heapgrow should make room");
+    assertf(h.len == 0, "heapgrow should add nothing");
+    data = h.data;
+    for (i = 0; i < 10; i++) {
+        j = make_job(1 + i, 0, 1, 0, 0);
+        assertf(j, "allocate job");
+        assertf(heapinsert(&h, j), "heapinsert");
+    }
+    assertf(h.data == data, "heapinsert should use the room made");
+    free(h.data);
+}
+
+
 void
 cttestheap_insert_and_remove_one()
 {
@@ -43,7 +68,7 @@ cttestheap_insert_and_remove_one()
     j = heapremove(&h, 0);
     assertf(j == j1, "j1 should come back out");
     assertf(h.len == 0, "h should be empty.");
-    printf("j->heap_index is %zu\n", j->heap_index);
+    printf("j->heap_index is %d\n", j->heap_index);
     assertf(j->heap_index == -1, "j's heap index should be invalid");
 }
 
@@ -240,3 +265,177 @@ ctbenchheapremove(int n)
         heapremove(&h, 0);
     }
 }
+
+void
+cttestjobheap_order()
+{
+    Jobheap h = {0};
+    job j;
+    int i, n = 1000;
+    uint last_pri = 0;
+    uint64 last_id = 0;
+
+    for (i = 0; i < n; i++) {
+        j = make_job(1 + rand() % 64, 0, 1, 0, 0);
+        assertf(j, "allocation");
+        assertf(jobheapinsert(&h, j, j->r.pri), "jobheapinsert");
+    }
+
+    /* remove some from the middle */
+    for (i = 0; i < 50; i++) {
+        j = jobheapremove(&h, rand() % h.len);
+        assertf(j->heap_index == -1, "j's heap index should be invalid");
+    }
+
+    for (i = 0; i < n - 50; i++) {
+        assertf(h.data[0].j->heap_index == 0, "heap index should match");
+        j = jobheapremove(&h, 0);
+        assertf(j->r.pri >= last_pri, "should come out in priority order");
+        if (j->r.pri == last_pri) {
+            assertf(j->r.id > last_id, "should be fifo within a priority");
+        }
+        last_pri = j->r.pri;
+        last_id = j->r.id;
+    }
+    assertf(h.len == 0, "h should be empty");
+    assertf(!jobheapremove(&h, 0), "nothing should come out");
+    free(h.data);
+}
+
+static void
+ckjobheap(Jobheap *h, int n)
+{
+    job j;
+    int i;
+    uint last_pri = 0;
+    uint64 last_id = 0;
+
+    assertf(h->len == n, "h should hold %d jobs, not %d", n, h->len);
+    for (i = 0; i < n; i++) {
+        assertf(h->data[0].j->heap_index == 0, "heap index should match");
+        j = jobheapremove(h, 0);
+        assertf(j->r.pri >= last_pri, "should come out in priority order");
+        if (j->r.pri == last_pri) {
+            assertf(j->r.id > last_id, "should be fifo within a priority");
+        }
+        last_pri = j->r.pri;
+        last_id = j->r.id;
+    }
+}
+
+void
+cttestjobheap_fix()
+{
+    Jobheap h = {0};
+    job j;
+    int i, k, n = 1000, few = 10;
+
+    for (i = 0; i < n; i++) {
+        j = make_job(1 + rand() % 64, 0, 1, 0, 0);
+        assertf(j, "allocation");
+        assertf(jobheapinsert(&h, j, j->r.pri), "jobheapinsert");
+    }
+
+    /* a few more, sifted into place */
+    assertf(jobheapgrow(&h, few), "jobheapgrow");
+    assertf(h.cap >= n + few, "jobheapgrow should make room");
+    for (k = h.len, i = 0; i < few; i++) {
+        j = make_job(1 + rand() % 64, 0, 1, 0, 0);
+        assertf(j, "allocation");
+        jobheappush(&h, j, j->r.pri);
+    }
+    jobheapfix(&h, k);
+    for (i = 0; i < h.len; i++) {
+        assertf(h.data[i].j->heap_index == i, "heap index should match");
+    }
+
+    /* many more, so the heap gets rebuilt */
+    assertf(jobheapgrow(&h, n), "jobheapgrow");
+    for (k = h.len, i = 0; i < n; i++) {
+        j = make_job(1 + rand() % 64, 0, 1, 0, 0);
+        assertf(j, "allocation");
+        jobheappush(&h, j, j->r.pri);
+    }
+    jobheapfix(&h, k);
+    ckjobheap(&h, 2*n + few);
+    free(h.data);
+}
+
+void
+cttestjobheap_fix_nothing_added()
+{
+    Jobheap h = {0};
+    job j;
+
+    jobheapfix(&h, 0);
+    assertf(h.len == 0, "h should be empty");
+
+    /* what's left past the end must not be touched */
+    j = make_job(1, 0, 1, 0, 0);
+    assertf(j, "allocation");
+    assertf(jobheapinsert(&h, j, j->r.pri), "jobheapinsert");
+    assertf(jobheapremove(&h, 0) == j, "j should come back out");
+    job_free(j);
+    assertf(jobheapgrow(&h, 10), "jobheapgrow");
+    jobheapfix(&h, h.len);
+    assertf(h.len == 0, "h should still be empty");
+    free(h.data);
+}
+
+void
+ctbenchjobheapinsert(int n)
+{
+    job *j;
+    int i;
+    j = calloc(n, sizeof *j);
+    assert(j);
+    for (i = 0; i < n; i++) {
+        j[i] = make_job(1, 0, 1, 0, 0);
+        assert(j[i]);
+        j[i]->r.pri = -j[i]->r.id;
+    }
+    Jobheap h = {0};
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        jobheapinsert(&h, j[i], j[i]->r.pri);
+    }
+}
+
+void
+ctbenchjobheapremove(int n)
+{
+    Jobheap h = {0};
+    job j;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        j = make_job(1, 0, 1, 0, 0);
+        assertf(j, "allocate job");
+        jobheapinsert(&h, j, j->r.pri);
+    }
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        jobheapremove(&h, 0);
+    }
+}
+
+void
+ctbenchjobheappush(int n)
+{
+    job *j;
+    int i;
+    j = calloc(n, sizeof *j);
+    assert(j);
+    for (i = 0; i < n; i++) {
+        j[i] = make_job(1, 0, 1, 0, 0);
+        assert(j[i]);
+        j[i]->r.pri = -j[i]->r.id;
+    }
+    Jobheap h = {0};
+    ctresettimer();
+    jobheapgrow(&h, n);
+    for (i = 0; i < n; i++) {
+        jobheappush(&h, j[i], j[i]->r.pri);
+    }
+    jobheapfix(&h, 0);
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ct/ct.h"
+#include "dat.h"
+
+
+void
+cttesthist_empty()
+{
+    Hist h = {0};
+
+    assertf(histpct(&h, 0.5) == 0, "empty hist should report 0");
+}
+
+
+void
+cttesthist_small()
+{
+    Hist h = {0};
+    int i;
+
+    // small values each get a bucket of their own
+    for (i = 1; i <= 4; i++) histadd(&h, i);
+    assertf(h.n == 4, "n should be 4, is %"PRIu64, h.n);
+    assertf(histpct(&h, 0) == 1, "min should be 1");
+    assertf(histpct(&h, 0.5) == 3, "median should be 3");
+    assertf(histpct(&h, 1) == 4, "max should be 4");
+}
+
+
+void
+cttesthist_precision()
+{
+    Hist h = {0};
+    int64 v, p;
+    int i;
+
+    for (i = 0; i < 1000; i++) histadd(&h, 1000000); // 1ms
+    histadd(&h, 5000000000LL); // 5s
+    assertf(h.max == 5000000000LL, "max should be exact");
+
+    p = histpct(&h, 0.5);
+    assertf(p >= 1000000 && p < 1000000 + 1000000/Histsub,
+            "median %"PRId64" should be within one bucket of 1ms", p);
+    p = histpct(&h, 0.999);
+    assertf(p < 1000000 + 1000000/Histsub, "p999 %"PRId64" should be 1ms", p);
+    assertf(histpct(&h, 1) == 5000000000LL, "p100 should be the max");
+
+    // huge values land in the last bucket, without overflow
+    v = (int64)1 << 62;
+    histadd(&h, v);
+    assertf(h.max == v, "max should be exact");
+    assertf(histpct(&h, 1) == v, "p100 should be the max");
+}
+
+
+void
+ctbenchhistadd(int n)
+{
+    Hist *h = new(Hist);
+    int i;
+
+    for (i = 0; i < n; i++) histadd(h, i * 7919);
+    free(h);
+}
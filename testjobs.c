@@ -75,20 +75,52 @@ cttestjob_hash_free()
 }
 
 void
-cttestjob_hash_free_next()
+cttestjob_hash_free_others()
 {
-    job a, b;
-    uint64 aid = 97, bid = 12386;
+    job a, b, c;
 
     TUBE_ASSIGN(default_tube, make_tube("default"));
-    b = make_job_with_id(0, 0, 1, 0, default_tube, bid);
-    a = make_job_with_id(0, 0, 1, 0, default_tube, aid);
+    a = make_job_with_id(0, 0, 1, 0, default_tube, 1);
+    b = make_job_with_id(0, 0, 1, 0, default_tube, 1 + (1 << 14));
+    c = make_job_with_id(0, 0, 1, 0, default_tube, 1 + (2 << 14));
 
-    assertf(a->ht_next == b, "b should be chained to a");
+    job_free(a);
+    assertf(job_find(1 + (1 << 14)) == b, "b should be found");
+    assertf(job_find(1 + (2 << 14)) == c, "c should be found");
 
     job_free(b);
+    assertf(job_find(1 + (2 << 14)) == c, "c should be found");
+    assertf(!job_find(1), "a should be missing");
+    job_free(c);
+}
+
+void
+cttestjob_hash_grow_shrink()
+{
+    int i, n = 100000;
+    job *jobs;
 
-    assertf(a->ht_next == NULL, "job should be missing");
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    jobs = calloc(n, sizeof(job));
+    for (i = 0; i < n; i++) {
+        jobs[i] = make_job_with_id(0, 0, 1, 0, default_tube, i * 7 + 1);
+        assertf(jobs[i], "job should be made");
+        assertf(job_find(i / 2 * 7 + 1) == jobs[i / 2], "job should be found");
+    }
+    assertf(get_all_jobs_used() == (size_t) n, "should match");
+
+    /* free every odd job, then most of the even ones */
+    for (i = 1; i < n; i += 2) job_free(jobs[i]);
+    for (i = 0; i < n; i++) {
+        assertf(job_find(i * 7 + 1) == (i % 2 ? NULL : jobs[i]), "should match");
+    }
+    for (i = 0; i < n - 100; i += 2) job_free(jobs[i]);
+    for (i = n - 100; i < n; i += 2) {
+        assertf(job_find(i * 7 + 1) == jobs[i], "job should be found");
+        job_free(jobs[i]);
+    }
+    assertf(get_all_jobs_used() == 0, "should match");
+    free(jobs);
 }
 
 void
@@ -128,6 +160,93 @@ cttestjob_100_000_jobs()
     assertf(get_all_jobs_used() == 0, "should match");
 }
 
+void
+cttestjob_pool_reuse()
+{
+    job a, b, x;
+    size_t bytes, used, nfree, used0;
+
+    job_pool_stats(&bytes, &used0, &nfree);
+
+    a = allocate_job(10);
+    job_pool_stats(&bytes, &used, &nfree);
+    assertf(bytes > 0, "should have a slab");
+    assertf(used == used0 + 1, "should match");
+
+    job_free(a);
+    job_pool_stats(&bytes, &used, &nfree);
+    assertf(used == used0, "should match");
+
+    b = allocate_job(12);
+    assertf(b == a, "freed slot should be reused");
+    assertf(b->r.body_size == 12, "should match");
+
+    x = allocate_job(1 << 16);
+    assertf(x, "allocate large job");
+    job_pool_stats(&bytes, &used, &nfree);
+    assertf(used == used0 + 1, "large jobs should not use the pool");
+
+    job_free(x);
+    job_free(b);
+}
+
+
+void
+cttestjob_pool_copy()
+{
+    job j, n;
+
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    j = make_job(1, 0, 1, 5, default_tube);
+    memcpy(j->body, "abc\r\n", 5);
+    n = job_copy(j);
+    assertf(n && n != j, "should copy");
+    assertf(n->r.state == Copy, "should be a copy");
+    assertf(memcmp(n->body, "abc\r\n", 5) == 0, "body should match");
+    job_free(n);
+    job_free(j);
+}
+
+#ifdef ZLIB
+void
+cttestjob_zip()
+{
+    int i;
+    job j, n;
+    char *b = malloc(2000);
+
+    assert(b);
+    for (i = 0; i < 2000; i++) b[i] = "{\"id\": 1, \"x\": \"abc\"}"[i % 22];
+    TUBE_ASSIGN(default_tube, make_tube("default"));
+    job_zip_min = 1000;
+    j = make_job(1, 0, 1, 2000, default_tube);
+    memcpy(j->body, b, 2000);
+    job_zip(j);
+    assertf(j->r.raw_size == 2000, "should be compressed");
+    assertf(j->r.body_size < 200, "should be smaller");
+    assertf(job_bodysize(j) == 2000, "clients should see the raw size");
+
+    n = job_copy(j);
+    assertf(n, "should copy");
+    assertf(!n->r.raw_size && n->r.body_size == 2000, "copy is raw");
+    assertf(memcmp(n->body, b, 2000) == 0, "body should match");
+    job_free(n);
+
+    job_zip(j);
+    assertf(j->r.raw_size == 2000, "should compress only once");
+    job_free(j);
+
+    /* too small */
+    j = make_job(1, 0, 1, 500, default_tube);
+    memcpy(j->body, b, 500);
+    job_zip(j);
+    assertf(!j->r.raw_size, "should not be compressed");
+    job_free(j);
+    job_zip_min = 0;
+    free(b);
+}
+#endif
+
 void
 ctbenchmakejob(int n)
 {
@@ -1,12 +1,15 @@
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -37,6 +40,20 @@ wrapfalloc(int fd, int size)
 }
 
 
+// Shortfalloc allocates nothing, and limits the size of the files
+// this process writes to the version number at the start of the
+// binlog, so every write after that fails.
+static int
+shortfalloc(int fd, int size)
+{
+    struct rlimit r = {sizeof(int), sizeof(int)};
+
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &r);
+    return 0;
+}
+
+
 static void
 muststart(char *a0, char *a1, char *a2, char *a3, char *a4)
 {
@@ -90,28 +107,13 @@ mustdiallocal(int port)
 }
 
 
-#define SERVER() (progname=__func__, mustforksrv())
-
-static int
-mustforksrv()
+/* Forksrv runs the server on srv.sock.fd in a child process,
+ * and returns in the parent. */
+static void
+forksrv()
 {
-    int r, len, port, ok;
-    struct sockaddr_in addr;
-
-    srv.sock.fd = make_server_socket("127.0.0.1", "0");
-    if (srv.sock.fd == -1) {
-        puts("mustforksrv failed");
-        exit(1);
-    }
-
-    len = sizeof(addr);
-    r = getsockname(srv.sock.fd, (struct sockaddr*)&addr, (socklen_t*)&len);
-    if (r == -1 || len > sizeof(addr)) {
-        puts("mustforksrv failed");
-        exit(1);
-    }
+    int ok;
 
-    port = ntohs(addr.sin_port);
     srvpid = fork();
     if (srvpid < 0) {
         twarn("fork");
@@ -119,8 +121,7 @@ mustforksrv()
     }
 
     if (srvpid > 0) {
-        printf("start server port=%d pid=%d\n", port, srvpid);
-        return port;
+        return;
     }
 
     /* now in child */
@@ -151,12 +152,40 @@ mustforksrv()
 }
 
 
+#define SERVER() (progname=__func__, mustforksrv())
+
+static int
+mustforksrv()
+{
+    int r, len, port;
+    struct sockaddr_in addr;
+
+    srv.sock.fd = make_server_socket("127.0.0.1", "0");
+    if (srv.sock.fd == -1) {
+        puts("mustforksrv failed");
+        exit(1);
+    }
+
+    len = sizeof(addr);
+    r = getsockname(srv.sock.fd, (struct sockaddr*)&addr, (socklen_t*)&len);
+    if (r == -1 || len > sizeof(addr)) {
+        puts("mustforksrv failed");
+        exit(1);
+    }
+
+    port = ntohs(addr.sin_port);
+    forksrv();
+    printf("start server port=%d pid=%d\n", port, srvpid);
+    return port;
+}
+
+
 static char *
 readline(int fd)
 {
     int r, i = 0;
     char c = 0, p = 0;
-    static char buf[1024];
+    static char buf[16384];
     fd_set rfd;
     struct timeval tv;
 
@@ -248,6 +277,85 @@ mustsend(int fd, char *s)
 }
 
 
+static void
+putle(char *p, uint64 v, int n)
+{
+    for (; n; n--, v >>= 8) *p++ = v;
+}
+
+
+static uint64
+getle(char *p, int n)
+{
+    uint64 v = 0;
+
+    while (n--) v = v << 8 | (byte)p[n];
+    return v;
+}
+
+
+/* Send a binary protocol frame, with n bytes of data after the header. */
+static void
+sendbin(int fd, int op, uint pri, uint64 id, uint delay, uint ttr,
+        char *data, int n)
+{
+    char h[32] = {'\xbe', op};
+
+    putle(h + 4, pri, 4);
+    putle(h + 8, id, 8);
+    putle(h + 16, delay, 4);
+    putle(h + 20, ttr, 4);
+    putle(h + 24, n, 4);
+    writefull(fd, h, sizeof h);
+    writefull(fd, data, n);
+    printf(">%d binary %d %"PRIu64" %.*s\n", fd, op, id, n, data);
+    fflush(stdout);
+}
+
+
+static void
+readn(int fd, char *buf, int n)
+{
+    int r;
+    fd_set rfd;
+    struct timeval tv;
+
+    while (n) {
+        FD_ZERO(&rfd);
+        FD_SET(fd, &rfd);
+        tv.tv_sec = timeout / 1000000000;
+        tv.tv_usec = (timeout/1000) % 1000000;
+        r = select(fd+1, &rfd, NULL, NULL, &tv);
+        assertf(r == 1, "select: %d", r);
+        r = read(fd, buf, n);
+        assertf(r > 0, "read: %d", r);
+        buf += r;
+        n -= r;
+    }
+}
+
+
+/* Check for a binary reply, and for body after it, if not NULL. */
+static void
+ckbin(int fd, int status, uint64 id, uint n, char *body)
+{
+    char h[32], b[1024];
+    uint len = body ? strlen(body) : 0;
+
+    readn(fd, h, sizeof h);
+    printf("<%d binary %d %"PRIu64" %u\n", fd, h[1], getle(h + 8, 8),
+           (uint)getle(h + 4, 4));
+    assertf((byte)h[0] == 0xbe, "magic %x", (byte)h[0]);
+    assertf(h[1] == status, "status %d != %d", h[1], status);
+    assertf(getle(h + 8, 8) == id, "id %"PRIu64" != %"PRIu64,
+            getle(h + 8, 8), id);
+    assertf(getle(h + 4, 4) == n, "count %u != %u", (uint)getle(h + 4, 4), n);
+    assertf(getle(h + 24, 4) == len, "len %u != %u", (uint)getle(h + 24, 4), len);
+    readn(fd, b, len);
+    assertf(memcmp(b, body, len) == 0, "body %.*s != %s", len, b, body);
+}
+
+
 static int
 filesize(char *path)
 {
@@ -304,6 +412,79 @@ cttestunderscore()
 }
 
 
+void
+cttestmanytubes()
+{
+    int i;
+    char buf[50];
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 0; i < 100; i++) {
+        sprintf(buf, "watch t%d\r\n", i);
+        mustsend(fd, buf);
+        sprintf(buf, "WATCHING %d\r\n", i + 2);
+        ckresp(fd, buf);
+    }
+    for (i = 0; i < 100; i += 2) {
+        sprintf(buf, "ignore t%d\r\n", i);
+        mustsend(fd, buf);
+        sprintf(buf, "WATCHING %d\r\n", 100 - i/2);
+        ckresp(fd, buf);
+    }
+    for (i = 0; i < 100; i++) {
+        sprintf(buf, "stats-tube t%d\r\n", i);
+        mustsend(fd, buf);
+        if (i % 2) {
+            ckrespsub(fd, "OK ");
+            sprintf(buf, "\nname: t%d\n", i);
+            ckrespsub(fd, buf);
+        } else {
+            ckresp(fd, "NOT_FOUND\r\n");
+        }
+    }
+    mustsend(fd, "watch t0\r\n");
+    ckresp(fd, "WATCHING 52\r\n");
+    mustsend(fd, "stats-tube t0\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nname: t0\n");
+}
+
+
+void
+cttestmanyconns()
+{
+    int i, fds[20];
+
+    port = SERVER();
+    for (i = 0; i < 20; i++) {
+        fds[i] = mustdiallocal(port);
+    }
+    for (i = 0; i < 20; i++) {
+        mustsend(fds[i], "put 0 0 100 1\r\nx\r\n");
+        if (i % 2) {
+            mustsend(fds[i], "quit\r\n");
+        }
+    }
+    for (i = 0; i < 20; i += 2) {
+        ckrespsub(fds[i], "INSERTED ");
+    }
+    usleep(100000); // .1s; time for the server to see the quits
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 20\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-connections: 11\n");
+    for (i = 0; i < 20; i += 2) {
+        mustsend(fds[i], "reserve-with-timeout 0\r\n");
+        ckrespsub(fds[i], "RESERVED ");
+        ckresp(fds[i], "x\r\n");
+    }
+}
+
+
 void
 cttest2cmdpacket()
 {
@@ -316,108 +497,520 @@ cttest2cmdpacket()
 
 
 void
-cttesttoobig()
+cttestpipelined()
 {
-    job_data_size_limit = 10;
+    int i;
+    char *s = "";
+
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 11\r\n");
-    mustsend(fd, "delete 9999\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
-    ckresp(fd, "JOB_TOO_BIG\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    for (i = 0; i < 200; i++) {
+        s = fmtalloc("%sput 0 0 100 1\r\nx\r\n", s);
+    }
+    s = fmtalloc("%speek 200\r\nreserve-with-timeout 1\r\n"
+                 "reserve-with-timeout 1\r\n", s);
+    mustsend(fd, s);
+    for (i = 1; i <= 200; i++) {
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+    }
+    ckresp(fd, "FOUND 200 1\r\n");
+    ckresp(fd, "x\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "x\r\n");
 }
 
 
 void
-cttestdeleteready()
+cttestpipelinedhalfclose()
 {
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 0\r\n");
-    mustsend(fd, "\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\nuse a\r\nput 0 0 100 1\r\ny\r\n");
+    shutdown(fd, SHUT_WR);
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
+    ckresp(fd, "USING a\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
 }
 
 
 void
-cttestmultitube()
+cttestpipelinedwait()
 {
+    int fd2;
+
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "use abc\r\n");
-    ckresp(fd, "USING abc\r\n");
-    mustsend(fd, "put 999999 0 0 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "use def\r\n");
-    ckresp(fd, "USING def\r\n");
-    mustsend(fd, "put 99 0 0 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 2\r\n");
-    mustsend(fd, "watch abc\r\n");
+    fd2 = mustdiallocal(port);
+    mustsend(fd, "watch a\r\nreserve\r\n");
     ckresp(fd, "WATCHING 2\r\n");
-    mustsend(fd, "watch def\r\n");
-    ckresp(fd, "WATCHING 3\r\n");
-    mustsend(fd, "reserve\r\n");
-    ckresp(fd, "RESERVED 2 0\r\n");
+    mustsend(fd2, "use a\r\nput 0 0 100 1\r\nx\r\n");
+    ckresp(fd2, "USING a\r\n");
+    ckresp(fd2, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
 }
 
 
 void
-cttestnonegativedelay()
+cttestputbatch()
 {
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "put 512 -1 100 0\r\n");
+    mustsend(fd, "put-batch 5 0 100 3\r\n1\r\na\r\n2\r\nbb\r\n0\r\n\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npri: 5\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-put-batch: 1\n");
+}
+
+
+void
+cttestputbatchinterleaved()
+{
+    int fd2;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    fd2 = mustdiallocal(port);
+    mustsend(fd, "put-batch 0 0 100 2\r\n1\r\na\r\n");
+    mustsend(fd2, "put 0 0 100 1\r\nb\r\n");
+    ckresp(fd2, "INSERTED 3\r\n");
+    mustsend(fd, "1\r\nc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 2\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "c\r\n");
+}
+
+
+void
+cttestputbatchbad()
+{
+    job_data_size_limit = 10;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 0 0 100 0\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-batch 0 0 100 3\r\n1\r\na\r\n11\r\nxxxxxxxxxxx\r\n");
+    mustsend(fd, "1\r\nb\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+    mustsend(fd, "put-batch 0 0 100 2\r\n1\r\nab\r\n1\r\nc\r\n");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+    mustsend(fd, "put-batch 0 0 100 2\r\nx\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 0\n");
 }
 
 
 void
-cttestomittimeleft()
+cttestbinlogputbatch()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "use test\r\n");
+    ckresp(fd, "USING test\r\n");
+    mustsend(fd, "put-batch 0 0 100 3\r\n1\r\na\r\n1\r\nb\r\n1\r\nc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "watch test\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+}
+
+
+void
+cttestreservebatch()
 {
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 5 1\r\n");
-    mustsend(fd, "a\r\n");
+    mustsend(fd, "put 3 0 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "stats-job 1\r\n");
+    mustsend(fd, "put 1 0 100 2\r\nbb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 2 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "use t\r\n");
+    ckresp(fd, "USING t\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nd\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "watch t\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+
+    mustsend(fd, "reserve-batch 3\r\n");
+    ckresp(fd, "RESERVED-BATCH 3\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "d\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+
+    mustsend(fd, "reserve-batch 5 0\r\n");
+    ckresp(fd, "RESERVED-BATCH 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve-batch 5 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+
+    mustsend(fd, "stats-job 2\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\ntime-left: 0\n");
+    ckrespsub(fd, "\nstate: reserved\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-reserved: 3\n");
 }
 
 
 void
-cttestsmalldelay()
+cttestreservebatchwait()
 {
+    int fd2;
+
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "put 0 1 1 0\r\n");
-    mustsend(fd, "\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    fd2 = mustdiallocal(port);
+    mustsend(fd, "reserve-batch 2\r\n");
+    mustsend(fd2, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd2, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED-BATCH 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    mustsend(fd, "reserve-batch 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 2 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 
 void
-ctteststatstube()
+cttestwaitmanytubes()
 {
+    int i, fds[3];
+
     port = SERVER();
     fd = mustdiallocal(port);
-    mustsend(fd, "use tubea\r\n");
-    ckresp(fd, "USING tubea\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
+    for (i = 0; i < 3; i++) {
+        fds[i] = mustdiallocal(port);
+        mustsend(fds[i], "watch a\r\n");
+        ckresp(fds[i], "WATCHING 2\r\n");
+        mustsend(fds[i], "watch b\r\n");
+        ckresp(fds[i], "WATCHING 3\r\n");
+        mustsend(fds[i], "reserve\r\n");
+    }
+
+    // each job goes to a different waiting conn
+    mustsend(fd, "use a\r\n");
+    ckresp(fd, "USING a\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "use b\r\n");
+    ckresp(fd, "USING b\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    for (i = 0; i < 3; i++) {
+        ckrespsub(fds[i], "RESERVED ");
+    }
 
-    mustsend(fd, "stats-tube tubea\r\n");
+    mustsend(fd, "stats-tube a\r\n");
     ckrespsub(fd, "OK ");
-    ckrespsub(fd, "\nname: tubea\n");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+    mustsend(fd, "stats-tube b\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-waiting: 0\n");
+}
+
+
+void
+cttestdeletebatch()
+{
+    int i;
+    char *s;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 0 0 100 300\r\n");
+    for (i = 0; i < 300; i++) {
+        mustsend(fd, "1\r\nx\r\n");
+    }
+    ckresp(fd, "INSERTED-BATCH 1 300\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+
+    // a command line longer than LINE_BUF_SIZE
+    s = "delete-batch 1 999";
+    for (i = 3; i <= 300; i++) {
+        s = fmtalloc("%s %d", s, i);
+    }
+    mustsend(fd, fmtalloc("%s\r\n", s));
+    ckresp(fd, "DELETED-BATCH 299\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "x\r\n");
+    mustsend(fd, "delete-batch 2\r\n");
+    ckresp(fd, "DELETED-BATCH 1\r\n");
+
+    mustsend(fd, "delete-batch \r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-batch 1 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete-batch: 2\n");
+}
+
+
+void
+cttestreleasetouchbatch()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 0 0 100 3\r\n1\r\na\r\n1\r\nb\r\n1\r\nc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "reserve-batch 3\r\n");
+    ckresp(fd, "RESERVED-BATCH 3\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+
+    mustsend(fd, "touch-batch 1 2 3 4\r\n");
+    ckresp(fd, "TOUCHED-BATCH 3\r\n");
+    mustsend(fd, "release-batch 7 0 3 1 4\r\n");
+    ckresp(fd, "RELEASED-BATCH 2\r\n");
+    mustsend(fd, "release-batch 0 100 2\r\n");
+    ckresp(fd, "RELEASED-BATCH 1\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npri: 7\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "touch-batch 2 3\r\n");
+    ckresp(fd, "TOUCHED-BATCH 0\r\n");
+    mustsend(fd, "release-batch 0 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+
+void
+cttesttoobig()
+{
+    job_data_size_limit = 10;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 11\r\n");
+    mustsend(fd, "delete 9999\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+
+void
+cttestdeleteready()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+
+void
+cttestmultitube()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "use abc\r\n");
+    ckresp(fd, "USING abc\r\n");
+    mustsend(fd, "put 999999 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use def\r\n");
+    ckresp(fd, "USING def\r\n");
+    mustsend(fd, "put 99 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "watch abc\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "watch def\r\n");
+    ckresp(fd, "WATCHING 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 0\r\n");
+}
+
+
+void
+cttestmultitubepaused()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "use abc\r\n");
+    ckresp(fd, "USING abc\r\n");
+    mustsend(fd, "put 1 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use def\r\n");
+    ckresp(fd, "USING def\r\n");
+    mustsend(fd, "put 5 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 3 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "pause-tube abc 60\r\n");
+    ckresp(fd, "PAUSED\r\n");
+    mustsend(fd, "watch abc\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "watch def\r\n");
+    ckresp(fd, "WATCHING 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 3 0\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 0\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "pause-tube abc 0\r\n");
+    ckresp(fd, "PAUSED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 0\r\n");
+    ckresp(fd, "\r\n");
+}
+
+
+void
+cttestdelaymultitube()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "use a\r\n");
+    ckresp(fd, "USING a\r\n");
+    mustsend(fd, "put 0 2 10 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use b\r\n");
+    ckresp(fd, "USING b\r\n");
+    mustsend(fd, "put 0 1 10 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 2\n");
+    mustsend(fd, "watch a\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "watch b\r\n");
+    ckresp(fd, "WATCHING 3\r\n");
+    mustsend(fd, "reserve-with-timeout 5\r\n");
+    ckresp(fd, "RESERVED 2 0\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 1\n");
+    mustsend(fd, "reserve-with-timeout 5\r\n");
+    ckresp(fd, "RESERVED 1 0\r\n");
+    ckresp(fd, "\r\n");
+}
+
+
+void
+cttestnonegativedelay()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 512 -1 100 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+
+void
+cttestomittimeleft()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 5 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntime-left: 0\n");
+}
+
+
+void
+cttestsmalldelay()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 1 1 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+
+void
+ctteststatstube()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "use tubea\r\n");
+    ckresp(fd, "USING tubea\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    mustsend(fd, "stats-tube tubea\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nname: tubea\n");
     mustsend(fd, "stats-tube tubea\r\n");
     ckrespsub(fd, "OK ");
     ckrespsub(fd, "\ncurrent-jobs-urgent: 0\n");
@@ -598,6 +1191,76 @@ cttestreservewithtimeout2conn()
 }
 
 
+void
+cttestargs()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 4294967296 0 100 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 100 1 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 4294967295 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 1 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    writefull(fd, "peek 1\0x\r\n", 10);
+    ckresp(fd, "BAD_FORMAT\r\n");
+    writefull(fd, "use a\0x\r\n", 9);
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "kick-job 18446744073709551616\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-with-timeout -\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "pause-tube default 1 2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "pause-tube default 0\r\n");
+    ckresp(fd, "PAUSED\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
+}
+
+
+void
+cttestreserveddeadlines()
+{
+    int fd0, fd1;
+
+    port = SERVER();
+    fd0 = mustdiallocal(port);
+    fd1 = mustdiallocal(port);
+    mustsend(fd0, "put 0 0 1 1\r\na\r\n");
+    ckresp(fd0, "INSERTED 1\r\n");
+    mustsend(fd0, "put 0 0 1 1\r\nb\r\n");
+    ckresp(fd0, "INSERTED 2\r\n");
+    mustsend(fd0, "put 0 0 100 1\r\nc\r\n");
+    ckresp(fd0, "INSERTED 3\r\n");
+    mustsend(fd0, "reserve-batch 3\r\n");
+    ckresp(fd0, "RESERVED-BATCH 3\r\n");
+    ckresp(fd0, "RESERVED 1 1\r\n");
+    ckresp(fd0, "a\r\n");
+    ckresp(fd0, "RESERVED 2 1\r\n");
+    ckresp(fd0, "b\r\n");
+    ckresp(fd0, "RESERVED 3 1\r\n");
+    ckresp(fd0, "c\r\n");
+    mustsend(fd0, "touch 3\r\n");
+    ckresp(fd0, "TOUCHED\r\n");
+    mustsend(fd0, "delete 1\r\n");
+    ckresp(fd0, "DELETED\r\n");
+
+    // job 2 times out first; job 3 stays reserved
+    mustsend(fd1, "reserve-with-timeout 3\r\n");
+    timeout = 2500000000; // 2.5s
+    ckresp(fd1, "RESERVED 2 1\r\n");
+    ckresp(fd1, "b\r\n");
+    mustsend(fd0, "delete 3\r\n");
+    ckresp(fd0, "DELETED\r\n");
+}
+
+
 void
 cttestunpausetube()
 {
@@ -689,6 +1352,44 @@ cttestbinlogbasic()
 }
 
 
+void
+cttestbinlogjobstats()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_data_size_limit = 10;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 3 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    mustsend(fd, "release 1 5 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    mustsend(fd, "bury 1 7\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npri: 7\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nreserves: 2\ntimeouts: 0\nreleases: 1\nburies: 1\nkicks: 1\n");
+}
+
+
 void
 cttestbinlogsizelimit()
 {
@@ -794,7 +1495,96 @@ cttestbinlogread()
 
 
 void
-cttestbinlogdiskfull()
+cttestbinlogreadmanyfiles()
+{
+    int i;
+
+    size = 1024;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 1; i <= 40; i++) {
+        mustsend(fd, "put 0 0 120 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+    }
+    for (i = 2; i <= 40; i += 2) {
+        mustsend(fd, fmtalloc("delete %d\r\n", i));
+        ckresp(fd, "DELETED\r\n");
+    }
+    assert(exist(fmtalloc("%s/binlog.3", ctdir())));
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 20\n");
+    mustsend(fd, "peek 40\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 39\r\n");
+    ckresp(fd, "FOUND 39 50\r\n");
+    ckresp(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+}
+
+
+void
+cttestbinlogpipelined()
+{
+    int i;
+    char *big, *s;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+    job_data_size_limit = 100000;
+
+    // a body bigger than the wal write buffer, between small ones
+    big = calloc(1, 70002);
+    memset(big, 'y', 70000);
+    memcpy(big + 70000, "\r\n", 2);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    s = "";
+    for (i = 0; i < 50; i++) {
+        s = fmtalloc("%sput 0 0 120 1\r\nx\r\n", s);
+    }
+    mustsend(fd, fmtalloc("%sput 0 0 120 70000\r\n", s));
+    writefull(fd, big, 70002);
+    mustsend(fd, s);
+    for (i = 1; i <= 101; i++) {
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+    }
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 100\n");
+    mustsend(fd, "peek 101\r\n");
+    ckresp(fd, "FOUND 101 1\r\n");
+    ckresp(fd, "x\r\n");
+    mustsend(fd, "peek 51\r\n");
+    ckresp(fd, "FOUND 51 70000\r\n");
+}
+
+
+void
+cttestbinlogdiskfull()
 {
     size = 1000;
     falloc = &wrapfalloc;
@@ -1141,3 +1931,900 @@ ctbenchputdelete8k(int n)
 {
     benchputdeletesize(n, 8192);
 }
+
+
+// Benchcmd sends cmd n times, pipelined in rounds of 100, and reads the
+// one-line reply to each. The round trips are shared by a whole round,
+// so this mostly measures how fast the server reads and parses cmd.
+static void
+benchcmd(int n, char *cmd)
+{
+    int i, j, m, got, len = strlen(cmd);
+    char *buf = malloc(len * 100), rbuf[4096];
+
+    for (i = 0; i < 100; i++) memcpy(buf + i*len, cmd, len);
+    port = SERVER();
+    fd = mustdiallocal(port);
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(n - i, 100);
+        writefull(fd, buf, m*len);
+        for (got = 0; got < m;) {
+            j = read(fd, rbuf, sizeof rbuf);
+            assertf(j > 0, "read");
+            for (; j--;) got += rbuf[j] == '\n';
+        }
+    }
+    free(buf);
+}
+
+
+void
+ctbenchparseput(int n)
+{
+    benchcmd(n, "put 4294967295 4294967295 4294967295 1\r\nx\r\n");
+}
+
+
+void
+ctbenchparsedelete(int n)
+{
+    benchcmd(n, "delete 18446744073709551615\r\n");
+}
+
+
+void
+ctbenchparserelease(int n)
+{
+    benchcmd(n, "release 18446744073709551615 4294967295 4294967295\r\n");
+}
+
+
+void
+ctbenchparsetouch(int n)
+{
+    benchcmd(n, "touch 18446744073709551615\r\n");
+}
+
+
+void
+ctbenchparsekickjob(int n)
+{
+    benchcmd(n, "kick-job 18446744073709551615\r\n");
+}
+
+
+void
+ctbenchparseuse(int n)
+{
+    benchcmd(n, "use the-default-tube-name\r\n");
+}
+
+
+void
+ctbenchparsereservetimeout(int n)
+{
+    benchcmd(n, "reserve-with-timeout 0\r\n");
+}
+
+
+static char *
+bigbody(int n)
+{
+    int i;
+    char *b;
+
+    b = malloc(n + 3);
+    assert(b);
+    for (i = 0; i < n; i++) b[i] = 'a' + i % 26;
+    strcpy(b + n, "\r\n");
+    return b;
+}
+
+
+void
+cttestbinlogbigbody()
+{
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.bigbody = 300;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\ny\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "release 1 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "reserve-batch 2\r\n");
+    ckresp(fd, "RESERVED-BATCH 2\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "y\r\n");
+    mustsend(fd, "release 1 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+}
+
+
+void
+cttestbinlogkickwritefail()
+{
+    int n, w = sizeof(Walrec);
+    char *b, *p, buf[70000];
+
+    falloc = &shortfalloc;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    // Two delayed jobs whose records fill the 64K write buffer exactly,
+    // and a kick in the same write, so writing the first kick record
+    // means flushing the buffer, which fails. No job is ready.
+    n = (64 << 10) - 2*(sizeof(int) + 7 + w) - 3 - 2;
+    b = bigbody(n);
+    p = buf;
+    p += sprintf(p, "put 0 100 100 1\r\nx\r\n");
+    p += sprintf(p, "put 0 100 100 %d\r\n%s", n, b);
+    p += sprintf(p, "kick 2\r\n");
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    writefull(fd, buf, p - buf);
+    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    ckresp(fd, "KICKED 0\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 0\ncurrent-jobs-reserved: 0\n"
+              "current-jobs-delayed: 2\n");
+    free(b);
+}
+
+
+void
+cttestbinlogbigbodymigrate()
+{
+    int i;
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+    srv.wal.bigbody = 300;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+
+    // make garbage until job 1 gets moved out of binlog.1
+    for (i = 2; exist(fmtalloc("%s/binlog.1", ctdir())); i++) {
+        mustsend(fd, "put 0 0 100 1000\r\n");
+        mustsend(fd, b);
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+        mustsend(fd, fmtalloc("delete %d\r\n", i));
+        ckresp(fd, "DELETED\r\n");
+        assertf(i < 100, "binlog.1 should be collected");
+    }
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+}
+
+
+void
+cttestbinloggroupcommit()
+{
+    int i, r, n, ticks, fds[20];
+    char *line, *p, *q;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    port = SERVER();
+    for (i = 0; i < 20; i++) {
+        fds[i] = mustdiallocal(port);
+        mustsend(fds[i], "put 0 0 100 1\r\nx\r\n");
+    }
+    // each client puts again as soon as it hears back, so the server
+    // sees replies and new commands interleaved
+    for (r = 1; r < 10; r++) {
+        for (i = 0; i < 20; i++) {
+            ckrespsub(fds[i], "INSERTED ");
+            mustsend(fds[i], "put 0 0 100 1\r\nx\r\n");
+        }
+    }
+    for (i = 0; i < 20; i++) {
+        ckrespsub(fds[i], "INSERTED ");
+    }
+
+    mustsend(fds[0], "stats-latency\r\n");
+    ckrespsub(fds[0], "OK ");
+    line = readline(fds[0]);
+    p = strstr(line, "\nwal-sync-count: ");
+    q = strstr(line, "\nloop-tick-count: ");
+    assert(p && q);
+    n = atoi(p + 17);
+    ticks = atoi(q + 18);
+
+    // at most one sync per pass of the event loop
+    assertf(n > 0 && n <= ticks, "%d syncs in %d passes", n, ticks);
+}
+
+
+void
+cttestbinlogspill()
+{
+    char *b = bigbody(500);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.spill = 1;
+    srv.wal.spilldelay = 10 * 1000000000LL;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 100 100 500\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 500\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 500\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "bury 2 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    mustsend(fd, "peek-delayed\r\n");
+    ckresp(fd, "FOUND 1 500\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "peek-buried\r\n");
+    ckresp(fd, "FOUND 2 500\r\n");
+    ckresp(fd, b);
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek-buried\r\n");
+    ckresp(fd, "FOUND 2 500\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 500\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 500\r\n");
+    ckresp(fd, b);
+}
+
+
+void
+cttestbinlogspillmigrate()
+{
+    int i;
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+    srv.wal.spill = 1;
+    srv.wal.spilldelay = 10 * 1000000000LL;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    // make garbage until job 1 gets moved out of binlog.1; its body
+    // must then be read from where it was moved to
+    for (i = 2; exist(fmtalloc("%s/binlog.1", ctdir())); i++) {
+        mustsend(fd, "put 0 0 100 1000\r\n");
+        mustsend(fd, b);
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+        mustsend(fd, fmtalloc("delete %d\r\n", i));
+        ckresp(fd, "DELETED\r\n");
+        assertf(i < 100, "binlog.1 should be collected");
+    }
+    mustsend(fd, "peek-buried\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+}
+
+
+void
+cttestbinlogcompactbudget()
+{
+    int i;
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+    srv.wal.compbudget = 1;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    for (i = 2; i < 30; i++) {
+        mustsend(fd, "put 0 0 100 1000\r\n");
+        mustsend(fd, b);
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+        mustsend(fd, fmtalloc("delete %d\r\n", i));
+        ckresp(fd, "DELETED\r\n");
+    }
+
+    // the first move spends far more than a second's budget
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-records-migrated: 1\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+}
+
+
+void
+cttestbinlogspare()
+{
+    int i;
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+    srv.wal.nspare = 2;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    assertf(exist(fmtalloc("%s/binlog.3", ctdir())), "binlog.3 should be a spare");
+
+    // make garbage until binlog.1 gets collected
+    for (i = 2; exist(fmtalloc("%s/binlog.1", ctdir())); i++) {
+        mustsend(fd, "put 0 0 100 1000\r\n");
+        mustsend(fd, b);
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+        mustsend(fd, fmtalloc("delete %d\r\n", i));
+        ckresp(fd, "DELETED\r\n");
+        assertf(i < 100, "binlog.1 should be collected");
+    }
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, fmtalloc("peek %d\r\n", i-1));
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+}
+
+
+static void
+putdelayed(int n, int first)
+{
+    int i;
+    char *b = malloc(n * 6 + 1);
+
+    assert(b);
+    for (i = 0; i < n; i++) memcpy(b + i*6, "1\r\nx\r\n", 6);
+    b[n*6] = '\0';
+    mustsend(fd, fmtalloc("put-batch 0 100 100 %d\r\n", n));
+    mustsend(fd, b);
+    ckresp(fd, fmtalloc("INSERTED-BATCH %d %d\r\n", first, n));
+    free(b);
+}
+
+
+void
+cttestkickbulk()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    putdelayed(10000, 1);
+    putdelayed(10000, 10001);
+    putdelayed(10000, 20001);
+
+    // more than one pass of the event loop
+    mustsend(fd, "kick 20000\r\n");
+    ckresp(fd, "KICKED 20000\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 20000\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+
+    // commands after a kick wait for it
+    mustsend(fd, "kick 100000\r\nput 0 0 100 1\r\ny\r\n");
+    ckresp(fd, "KICKED 10000\r\n");
+    ckresp(fd, "INSERTED 30001\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-delayed: 0\n");
+}
+
+
+void
+cttestkickbulkburied()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    putdelayed(10, 1);
+    mustsend(fd, "put 9 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 11\r\n");
+    mustsend(fd, "put 8 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 12\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 12 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 11 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "bury 11 9\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "bury 12 8\r\n");
+    ckresp(fd, "BURIED\r\n");
+
+    // only the buried ones, and in priority order after
+    mustsend(fd, "kick 5\r\n");
+    ckresp(fd, "KICKED 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 12 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "stats-job 11\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nkicks: 1\n");
+    mustsend(fd, "kick 5\r\n");
+    ckresp(fd, "KICKED 5\r\n");
+}
+
+
+void
+cttestbinlogsnapshot()
+{
+    int i;
+    char *b = bigbody(1000);
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.snapsize = 1000;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    // it is written in the background, and counted once it's in place
+    for (i = 0; ; i++) {
+        assertf(i < 500, "snapshot should be written");
+        mustsend(fd, "stats\r\n");
+        ckrespsub(fd, "OK ");
+        if (strstr(readline(fd), "\nbinlog-snapshots: 1\n")) break;
+        usleep(10000);
+    }
+    assertf(exist(fmtalloc("%s/snapshot", ctdir())), "snapshot should exist");
+
+    // these go only in the binlog, after the snapshot
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "bury 1 1\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put 0 0 100 3\r\nnew\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nkicks: 1\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "FOUND 3 3\r\n");
+    ckresp(fd, "new\r\n");
+}
+
+
+void
+cttestbinlogsnapshotbad()
+{
+    int sfd;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    sfd = open(fmtalloc("%s/snapshot", ctdir()), O_WRONLY|O_CREAT, 0600);
+    assertf(sfd >= 0, "open snapshot");
+    assertf(write(sfd, "garbage", 7) == 7, "write snapshot");
+    close(sfd);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "x\r\n");
+}
+
+
+void
+ctteststatslatency()
+{
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "stats-latency\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-delete-count: 1\n");
+    mustsend(fd, "stats-latency x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nqueue-wait-count: 1\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\njob-run-count: 1\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncmd-stats-latency: 1\n");
+}
+
+
+#ifdef ZLIB
+void
+cttestbinlogzip()
+{
+    char *b = bigbody(2000), *r = bigbody(2000), *tmp;
+
+    r[0] = 'x'; /* this one doesn't compress */
+    for (tmp = r + 1; tmp < r + 2000; tmp++) *tmp = 'a' + rand() % 26;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    job_zip_min = 1000;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 2000\r\n");
+    mustsend(fd, b);
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-batch 0 0 100 1\r\n2000\r\n");
+    mustsend(fd, r);
+    ckresp(fd, "INSERTED-BATCH 2 1\r\n");
+    mustsend(fd, "reserve-batch 2\r\n");
+    ckresp(fd, "RESERVED-BATCH 2\r\n");
+    ckresp(fd, "RESERVED 1 2000\r\n");
+    ckresp(fd, b);
+    ckresp(fd, "RESERVED 2 2000\r\n");
+    ckresp(fd, r);
+
+    kill(srvpid, 9);
+    waitpid(srvpid, NULL, 0);
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 2000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 2000\r\n");
+    ckresp(fd, b);
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 2000\r\n");
+    ckresp(fd, r);
+}
+#endif
+
+
+void
+cttestunixsocket()
+{
+    int r;
+    char *path;
+    struct sockaddr_un addr = {};
+
+    progname = __func__;
+    path = fmtalloc("%s/sock", ctdir());
+    srv.sock.fd = make_server_socket(fmtalloc("unix:%s", path), NULL);
+    assert(srv.sock.fd != -1);
+    forksrv();
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    r = connect(fd, (struct sockaddr *)&addr, sizeof addr);
+    assert(r == 0);
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // the running server's socket is not taken over
+    assert(make_server_socket(fmtalloc("unix:%s", path), NULL) == -1);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+}
+
+
+void
+cttestunixsocketstale()
+{
+    int r;
+    char *path;
+    struct sockaddr_un addr = {};
+
+    path = fmtalloc("%s/sock", ctdir());
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    r = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    assert(r == 0);
+    close(fd);
+
+    // nothing listens on what's left behind, so it is replaced
+    fd = make_server_socket(fmtalloc("unix:%s", path), NULL);
+    assert(fd != -1);
+}
+
+
+void
+cttestacceptburst()
+{
+    int i, fds[200];
+
+    port = SERVER();
+    // all of these are waiting by the time the server sees the first
+    for (i = 0; i < 200; i++) {
+        fds[i] = mustdiallocal(port);
+    }
+    for (i = 0; i < 200; i++) {
+        mustsend(fds[i], "use burst\r\n");
+    }
+    for (i = 0; i < 200; i++) {
+        ckresp(fds[i], "USING burst\r\n");
+    }
+}
+
+
+/* Op codes and statuses of the binary protocol, as in doc/protocol.txt. */
+enum
+{
+    Bput = 1, Bpeek = 2, Breserve = 3, Bdelete = 4, Brelease = 5, Bbury = 6,
+    Bstats = 8, Buse = 11, Bwatch = 12, Bignore = 13, Breservetimeout = 20,
+    Btouch = 21, Bkickjob = 24,
+
+    Binserted = 1, Bburied = 2, Breserved = 3, Bfound = 4, Bdeleted = 5,
+    Breleased = 6, Btouched = 7, Bkicked = 8, Busing = 9, Bwatching = 10,
+    Bnotfound = 11, Bnotignored = 12, Btimedout = 14, Btoobig = 15, Bbadformat = 19,
+    Bunknown = 20,
+};
+
+
+void
+cttestbinary()
+{
+    int tfd;
+    char name[300];
+
+    job_data_size_limit = 10;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    tfd = mustdiallocal(port);
+
+    sendbin(fd, Bput, 5, 0, 0, 100, "hello", 5);
+    ckbin(fd, Binserted, 1, 0, NULL);
+
+    // text clients see the same job, with its "\r\n"
+    mustsend(tfd, "peek 1\r\n");
+    ckresp(tfd, "FOUND 1 5\r\n");
+    ckresp(tfd, "hello\r\n");
+
+    sendbin(fd, Bpeek, 0, 1, 0, 0, "", 0);
+    ckbin(fd, Bfound, 1, 0, "hello");
+    sendbin(fd, Breserve, 0, 0, 0, 0, "", 0);
+    ckbin(fd, Breserved, 1, 0, "hello");
+    sendbin(fd, Btouch, 0, 1, 0, 0, "", 0);
+    ckbin(fd, Btouched, 0, 0, NULL);
+    sendbin(fd, Brelease, 7, 1, 0, 0, "", 0);
+    ckbin(fd, Breleased, 0, 0, NULL);
+    sendbin(fd, Breserve, 0, 0, 0, 0, "", 0);
+    ckbin(fd, Breserved, 1, 0, "hello");
+    sendbin(fd, Bbury, 9, 1, 0, 0, "", 0);
+    ckbin(fd, Bburied, 0, 0, NULL);
+    sendbin(fd, Bkickjob, 0, 1, 0, 0, "", 0);
+    ckbin(fd, Bkicked, 0, 0, NULL);
+    mustsend(tfd, "stats-job 1\r\n");
+    ckrespsub(tfd, "OK ");
+    ckrespsub(tfd, "\npri: 9\n");
+    sendbin(fd, Bdelete, 0, 1, 0, 0, "", 0);
+    ckbin(fd, Bdeleted, 0, 0, NULL);
+    sendbin(fd, Bdelete, 0, 1, 0, 0, "", 0);
+    ckbin(fd, Bnotfound, 0, 0, NULL);
+
+    sendbin(fd, Buse, 0, 0, 0, 0, "foo", 3);
+    ckbin(fd, Busing, 0, 0, NULL);
+    sendbin(fd, Bwatch, 0, 0, 0, 0, "foo", 3);
+    ckbin(fd, Bwatching, 0, 2, NULL);
+    sendbin(fd, Bignore, 0, 0, 0, 0, "default", 7);
+    ckbin(fd, Bwatching, 0, 1, NULL);
+    sendbin(fd, Bignore, 0, 0, 0, 0, "foo", 3);
+    ckbin(fd, Bnotignored, 0, 0, NULL);
+    sendbin(fd, Bwatch, 0, 0, 0, 0, "-x", 2);
+    ckbin(fd, Bbadformat, 0, 0, NULL);
+    sendbin(fd, Breservetimeout, 0, 0, 0, 0, "", 0);
+    ckbin(fd, Btimedout, 0, 0, NULL);
+    sendbin(fd, Bstats, 0, 0, 0, 0, "", 0);
+    ckbin(fd, Bunknown, 0, 0, NULL);
+    sendbin(fd, Bput, 0, 0, 0, 100, "hello world", 11);
+    ckbin(fd, Btoobig, 0, 0, NULL);
+
+    // a name too long to be one is skipped, and the next frame read
+    memset(name, 'a', sizeof name);
+    sendbin(fd, Buse, 0, 0, 0, 0, name, sizeof name);
+    ckbin(fd, Bbadformat, 0, 0, NULL);
+    sendbin(fd, Bput, 0, 0, 0, 100, "x", 1);
+    ckbin(fd, Binserted, 2, 0, NULL);
+    mustsend(tfd, "stats-tube foo\r\n");
+    ckrespsub(tfd, "OK ");
+    ckrespsub(tfd, "\ncurrent-jobs-ready: 1\n");
+}
+
+
+void
+cttestbinarypipelined()
+{
+    int i;
+    char h[32], buf[100 * 40];
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+
+    // a text command first; the first binary frame switches over
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+
+    // many frames in one write
+    memset(buf, 0, sizeof buf);
+    for (i = 0; i < 100; i++) {
+        memset(h, 0, sizeof h);
+        h[0] = '\xbe';
+        h[1] = Bput;
+        putle(h + 20, 100, 4);
+        putle(h + 24, 8, 4);
+        memcpy(buf + i*40, h, 32);
+        snprintf(h, sizeof h, "job %04d", i);
+        memcpy(buf + i*40 + 32, h, 8);
+    }
+    writefull(fd, buf, sizeof buf);
+    for (i = 0; i < 100; i++) ckbin(fd, Binserted, i + 1, 0, NULL);
+
+    sendbin(fd, Bwatch, 0, 0, 0, 0, "foo", 3);
+    ckbin(fd, Bwatching, 0, 2, NULL);
+    for (i = 0; i < 100; i++) {
+        sendbin(fd, Breserve, 0, 0, 0, 0, "", 0);
+    }
+    for (i = 0; i < 100; i++) {
+        sprintf(buf, "job %04d", i);
+        ckbin(fd, Breserved, i + 1, 0, buf);
+    }
+}
+
+
+void
+cttestreservebatchbytes()
+{
+    int i;
+    char *b = bigbody(400000), *got = malloc(400002);
+
+    job_data_size_limit = 400000;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 1; i <= 3; i++) {
+        mustsend(fd, "put 0 0 100 400000\r\n");
+        mustsend(fd, b);
+        ckresp(fd, fmtalloc("INSERTED %d\r\n", i));
+    }
+
+    // a third would take the bodies past the limit
+    mustsend(fd, "reserve-batch 3\r\n");
+    ckresp(fd, "RESERVED-BATCH 2\r\n");
+    for (i = 1; i <= 2; i++) {
+        ckresp(fd, fmtalloc("RESERVED %d 400000\r\n", i));
+        readn(fd, got, 400002);
+        assert(memcmp(got, b, 400002) == 0);
+    }
+    mustsend(fd, "reserve-batch 3\r\n");
+    ckresp(fd, "RESERVED-BATCH 1\r\n");
+    ckresp(fd, "RESERVED 3 400000\r\n");
+    readn(fd, got, 400002);
+    assert(memcmp(got, b, 400002) == 0);
+}
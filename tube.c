@@ -5,6 +5,109 @@
 
 struct ms tubes;
 
+/* Open-addressing hash index over tubes, keyed by name. Linear probing;
+ * holds at most index_cap/2 entries, and index_cap is a power of two. */
+static tube *index_tubes;
+static size_t index_cap, index_used;
+
+static uint32
+name_hash(const char *name)
+{
+    uint32 h = 2166136261u; /* FNV-1a */
+
+    for (; *name; name++) {
+        h ^= (byte)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t
+index_slot(tube t)
+{
+    size_t i, mask = index_cap - 1;
+
+    for (i = t->hash & mask; index_tubes[i]; i = (i + 1) & mask) {
+        if (index_tubes[i] == t) return i;
+    }
+    return index_cap;
+}
+
+static void
+index_put(tube t)
+{
+    size_t i, mask = index_cap - 1;
+
+    for (i = t->hash & mask; index_tubes[i]; i = (i + 1) & mask);
+    index_tubes[i] = t;
+    index_used++;
+}
+
+// Returns 1 on success, 0 on failure (out of memory).
+static int
+index_grow()
+{
+    tube *old = index_tubes;
+    size_t i, old_cap = index_cap;
+
+    index_cap = old_cap ? old_cap << 1 : 16;
+    index_tubes = calloc(index_cap, sizeof(tube));
+    if (!index_tubes) {
+        index_tubes = old;
+        index_cap = old_cap;
+        return 0;
+    }
+
+    index_used = 0;
+    for (i = 0; i < old_cap; i++) {
+        if (old[i]) index_put(old[i]);
+    }
+    free(old);
+    return 1;
+}
+
+// Returns 1 on success, 0 on failure (out of memory).
+static int
+index_insert(tube t)
+{
+    if ((index_used + 1) * 2 > index_cap && !index_grow()) return 0;
+    index_put(t);
+    return 1;
+}
+
+static void
+index_remove(tube t)
+{
+    size_t i, j, k, mask = index_cap - 1;
+
+    if (!index_cap) return;
+    i = index_slot(t);
+    if (i == index_cap) return; /* not indexed */
+
+    /* Shift later members of the probe sequence back over the hole. */
+    index_tubes[i] = NULL;
+    index_used--;
+    for (j = (i + 1) & mask; index_tubes[j]; j = (j + 1) & mask) {
+        k = index_tubes[j]->hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        index_tubes[i] = index_tubes[j];
+        index_tubes[j] = NULL;
+        i = j;
+    }
+}
+
+static void
+waiter_set(ms a, Waiter *w, size_t i)
+{
+    w->pos = i;
+}
+
+static void
+waiter_unset(ms a, Waiter *w, size_t i)
+{
+    w->pos = -1;
+}
+
 tube
 make_tube(const char *name)
 {
@@ -16,14 +119,14 @@ make_tube(const char *name)
     t->name[MAX_TUBE_NAME_LEN - 1] = '\0';
     strncpy(t->name, name, MAX_TUBE_NAME_LEN - 1);
     if (t->name[MAX_TUBE_NAME_LEN - 1] != '\0') twarnx("truncating tube name");
+    t->hash = name_hash(t->name);
 
-    t->ready.less = job_pri_less;
-    t->delay.less = job_delay_less;
-    t->ready.rec = job_setheappos;
-    t->delay.rec = job_setheappos;
     t->buried = (struct job) { };
     t->buried.prev = t->buried.next = &t->buried;
-    ms_init(&t->waiting, NULL, NULL);
+    ms_init(&t->waiting, (ms_event_fn) waiter_set, (ms_event_fn) waiter_unset);
+    t->waiting.onmove = (ms_event_fn) waiter_set;
+    t->readypos = -1;
+    t->delaypos = -1;
 
     return t;
 }
@@ -31,10 +134,13 @@ make_tube(const char *name)
 static void
 tube_free(tube t)
 {
+    index_remove(t);
     prot_remove_tube(t);
     free(t->ready.data);
     free(t->delay.data);
     ms_clear(&t->waiting);
+    free(t->waithist);
+    free(t->runhist);
     free(t);
 }
 
@@ -66,8 +172,8 @@ make_and_insert_tube(const char *name)
 
     /* We want this global tube list to behave like "weak" refs, so don't
      * increment the ref count. */
-    r = ms_append(&tubes, t);
-    if (!r) return tube_dref(t), (tube) 0;
+    r = ms_append(&tubes, t) && index_insert(t) && prot_add_tube(t);
+    if (!r) return tube_free(t), (tube) 0;
 
     return t;
 }
@@ -76,11 +182,16 @@ tube
 tube_find(const char *name)
 {
     tube t;
-    size_t i;
+    uint32 h;
+    size_t i, mask = index_cap - 1;
+
+    if (!index_cap) return NULL;
 
-    for (i = 0; i < tubes.used; i++) {
-        t = tubes.items[i];
-        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) return t;
+    h = name_hash(name);
+    for (i = h & mask; (t = index_tubes[i]); i = (i + 1) & mask) {
+        if (t->hash == h && strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) {
+            return t;
+        }
     }
     return NULL;
 }
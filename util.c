@@ -100,17 +100,27 @@ usage(int code)
             "\n"
             "Options:\n"
             " -b DIR   write-ahead log directory\n"
+            " -B BYTES keep job bodies of at least BYTES only in the write-ahead log\n"
+            " -S SECS  keep bodies of buried jobs, and of jobs delayed for at least\n"
+            "            SECS seconds, only in the write-ahead log until needed\n"
             " -f MS    fsync at most once every MS milliseconds"
                        " (use -f0 for \"always fsync\")\n"
             " -F       never fsync (default)\n"
             " -l ADDR  listen on address (default is 0.0.0.0)\n"
+            "          or, as unix:PATH, on a Unix domain socket\n"
             " -p PORT  listen on port (default is " Portdef ")\n"
             " -u USER  become user and group\n"
             " -z BYTES set the maximum job size in bytes (default is %d)\n"
+            " -Z BYTES keep job bodies of at least BYTES compressed, in memory\n"
+            "            and in the write-ahead log (needs a build with ZLIB=1)\n"
             " -s BYTES set the size of each write-ahead log file (default is %d)\n"
             "            (will be rounded up to a multiple of 512 bytes)\n"
+            " -r COUNT keep COUNT spare write-ahead log files allocated ahead of use\n"
             " -c       compact the binlog (default)\n"
+            " -C BYTES let binlog compaction move at most BYTES per second\n"
             " -n       do not compact the binlog\n"
+            " -k BYTES snapshot the live jobs after each BYTES of binlog, so that\n"
+            "            recovery replays only the binlog written since\n"
             " -v       show version information\n"
             " -V       increase verbosity\n"
             " -h       show this help\n",
@@ -164,15 +174,31 @@ optparse(Server *s, char **argv)
                 case 'z':
                     job_data_size_limit = parse_size_t(EARGF(flagusage("-z")));
                     break;
+                case 'Z':
+                    job_zip_min = parse_size_t(EARGF(flagusage("-Z")));
+#ifndef ZLIB
+                    warnx("built without zlib; ignoring option: -Z");
+                    job_zip_min = 0;
+#endif
+                    break;
                 case 's':
                     s->wal.filesize = parse_size_t(EARGF(flagusage("-s")));
                     break;
+                case 'r':
+                    s->wal.nspare = parse_size_t(EARGF(flagusage("-r")));
+                    break;
                 case 'c':
                     s->wal.nocomp = 0;
                     break;
+                case 'C':
+                    s->wal.compbudget = parse_size_t(EARGF(flagusage("-C")));
+                    break;
                 case 'n':
                     s->wal.nocomp = 1;
                     break;
+                case 'k':
+                    s->wal.snapsize = parse_size_t(EARGF(flagusage("-k")));
+                    break;
                 case 'f':
                     ms = (int64)parse_size_t(EARGF(flagusage("-f")));
                     s->wal.syncrate = ms * 1000000;
@@ -188,6 +214,14 @@ optparse(Server *s, char **argv)
                     s->wal.dir = EARGF(flagusage("-b"));
                     s->wal.use = 1;
                     break;
+                case 'B':
+                    s->wal.bigbody = parse_size_t(EARGF(flagusage("-B")));
+                    break;
+                case 'S':
+                    s->wal.spilldelay = (int64)parse_size_t(EARGF(flagusage("-S")));
+                    s->wal.spilldelay *= 1000000000;
+                    s->wal.spill = 1;
+                    break;
                 case 'h':
                     usage(0);
                 case 'v':
@@ -13,6 +13,9 @@
 
 static int reserve(Wal *w, int n);
 
+// how often walmaint checks on a snapshot being written, in nanoseconds
+#define Snappoll 10000000LL
+
 
 // Reads w->dir for files matching binlog.NNN,
 // sets w->next to the next unused number, and
@@ -63,6 +66,8 @@ walgc(Wal *w)
         }
 
         w->nfile--;
+        if (f->rfd > -1) close(f->rfd);
+        f->rfd = -1;
         unlink(f->path);
         free(f->path);
         free(f);
@@ -70,6 +75,64 @@ walgc(Wal *w)
 }
 
 
+// Opens a new file, numbered w->next, ready to be added to w.
+// Returns NULL on error.
+static File *
+newfile(Wal *w)
+{
+    File *f;
+
+    f = new(File);
+    if (!f) {
+        twarnx("OOM");
+        return NULL;
+    }
+
+    if (!fileinit(f, w, w->next)) {
+        free(f);
+        twarnx("OOM");
+        return NULL;
+    }
+
+    filewopen(f);
+    if (!f->iswopen) {
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+
+    w->next++;
+    return f;
+}
+
+
+static void
+addspare(Wal *w, File *f)
+{
+    File **p;
+
+    for (p = &w->spare; *p; p = &(*p)->next);
+    *p = f;
+    f->next = NULL;
+    w->nspares++;
+}
+
+
+// Keepspare keeps w->nspare spare files ready for makenextfile,
+// so that rolling over to a new file doesn't wait on falloc.
+static void
+keepspare(Wal *w)
+{
+    File *f;
+
+    while (w->nspares < w->nspare) {
+        f = newfile(w);
+        if (!f) return; // try again on the next pass
+        addspare(w, f);
+    }
+}
+
+
 // returns 1 on success, 0 on error.
 static int
 usenext(Wal *w)
@@ -91,12 +154,7 @@ usenext(Wal *w)
 static int
 ratio(Wal *w)
 {
-    int64 n, d;
-
-    d = w->alive + w->resv;
-    n = (int64)w->nfile * (int64)w->filesize - d;
-    if (!d) return 0;
-    return n / d;
+    return waldeadratio(w);
 }
 
 
@@ -110,49 +168,105 @@ walresvmigrate(Wal *w, job j)
     // space for the delete is already reserved
     z += sizeof(int);
     z += strlen(j->tube->name);
-    z += sizeof(Jobrec);
+    z += sizeof(Walrec);
     z += j->r.body_size;
 
     return reserve(w, z);
 }
 
 
-static void
+// Returns the number of bytes moved, or 0 if no job was moved.
+static int
 moveone(Wal *w)
 {
+    int z, spilled;
     job j;
 
     if (w->head == w->cur || w->head->next == w->cur) {
         // no point in moving a job
-        return;
+        return 0;
     }
 
     j = w->head->jlist.fnext;
     if (!j || j == &w->head->jlist) {
         // head holds no jlist; can't happen
         twarnx("head holds no jlist");
-        return;
+        return 0;
+    }
+
+    // the body has to come along, and its old copy may go away
+    spilled = !j->body;
+    if (!job_loadbody(j)) {
+        return 0;
     }
 
-    if (!walresvmigrate(w, j)) {
+    z = walresvmigrate(w, j);
+    if (!z) {
         // it will not fit, so we'll try again later
-        return;
+        if (spilled || (w->bigbody && j->r.body_size >= w->bigbody)) {
+            job_dropbody(j);
+        }
+        return 0;
     }
 
     filermjob(w->head, j);
     w->nmig++;
+    w->nmigbytes += z;
+    w->ratebytes += z;
     walwrite(w, j);
+
+    // a spilled body goes back to living only in the log
+    if (spilled) walspill(w, j);
+    return z;
 }
 
 
-static void
-walcompact(Wal *w)
+// Walcompact moves live jobs out of the oldest files.
+// Each call moves at most ratio-1 jobs; under a budget (-C),
+// it stops once the budget is spent.
+// It returns how long to wait for more budget, or 0 if none is needed.
+static int64
+walcompact(Wal *w, int64 now)
 {
-    int r;
+    int r, z;
+    int64 dt;
 
-    for (r=ratio(w); r>=2; r--) {
-        moveone(w);
+    if (!w->compbudget) {
+        for (r=ratio(w); r>=2; r--) {
+            moveone(w);
+        }
+        return 0;
     }
+
+    // refill, allowing at most one second's worth to build up
+    dt = min(now - w->comptime, 1000000000);
+    w->comptime = now;
+    w->comptokens += dt * w->compbudget / 1000000000;
+    w->comptokens = min(w->comptokens, w->compbudget);
+
+    while (ratio(w) >= 2) {
+        if (w->comptokens <= 0) {
+            return (1 - w->comptokens) * 1000000000 / w->compbudget;
+        }
+        z = moveone(w);
+        if (!z) break;
+        w->comptokens -= z;
+    }
+    return 0;
+}
+
+
+// Waldeadratio returns the ratio of dead bytes to live bytes in w,
+// which compaction tries to keep below 2.
+double
+waldeadratio(Wal *w)
+{
+    int64 n, d;
+
+    d = w->alive + w->resv;
+    n = (int64)w->nfile * (int64)w->filesize - d;
+    if (!d) return 0;
+    return (double)n / d;
 }
 
 
@@ -160,13 +274,32 @@ static void
 walsync(Wal *w)
 {
     int64 now;
+    int r;
+
+    // a sync in the background counts only once it has finished
+    if (w->syncing) {
+        r = rawsyncdone();
+        if (!r) return;
+        if (r == 1) w->syncrec = w->syncing;
+        w->syncing = 0;
+        histadd(&w->synchist, nanoseconds() - w->lastsync);
+    }
 
+    if (w->syncrec == w->nrec) return; // nothing new to sync
     now = nanoseconds();
     if (w->wantsync && now >= w->lastsync+w->syncrate) {
         w->lastsync = now;
+        // under -f0 each reply waits for its sync; otherwise the
+        // sync may run in the background, if the OS lets it
+        if (w->syncrate && rawsyncstart(w->cur->fd)) {
+            w->syncing = w->nrec;
+            return;
+        }
+        w->syncrec = w->nrec;
         if (fsync(w->cur->fd) == -1) {
             twarn("fsync");
         }
+        histadd(&w->synchist, nanoseconds() - now);
     }
 }
 
@@ -179,13 +312,21 @@ int
 walwrite(Wal *w, job j)
 {
     int r = 0;
+    int64 t;
 
     if (!w->use) return 1;
+    t = nanoseconds();
     if (w->cur->resv > 0 || usenext(w)) {
         if (j->file) {
             r = filewrjobshort(w->cur, j);
         } else {
             r = filewrjobfull(w->cur, j);
+
+            // under -B, the copy on disk is the only one we keep
+            if (r && w->bigbody && j->r.body_size >= w->bigbody) {
+                r = filewflush(w->cur);
+                if (r) job_dropbody(j);
+            }
         }
     }
     if (!r) {
@@ -193,47 +334,130 @@ walwrite(Wal *w, job j)
         w->use = 0;
     }
     w->nrec++;
+    histadd(&w->writehist, nanoseconds() - t);
     return r;
 }
 
 
-void
+// Walmaint compacts w a little. The server calls this once per pass
+// of its event loop, rather than after each command, so compaction
+// doesn't add to the time taken by whatever command triggered it.
+// It returns how long the server may wait before calling it again.
+int64
 walmaint(Wal *w)
 {
-    if (w->use) {
-        if (!w->nocomp) {
-            walcompact(w);
+    int64 now, wait = 0;
+
+    if (!w->use) return 0;
+    now = nanoseconds();
+    if (now - w->ratetime >= 1000000000) {
+        w->migrate_rate = now - w->ratetime < 2000000000 ? w->ratebytes : 0;
+        w->ratebytes = 0;
+        w->ratetime = now;
+    }
+    if (!w->nocomp) {
+        wait = walcompact(w, now);
+    }
+    if (w->nspare) {
+        keepspare(w);
+    }
+    if (w->snappid && snapdone(w)) {
+        w->nsnap++;
+    }
+    if (w->snapsize && w->snapbytes >= w->snapsize && !w->snappid) {
+        w->snapbytes = 0;
+        snapstart(w);
+    }
+    if (w->snappid && (!wait || wait > Snappoll)) {
+        // come back to see if it's done
+        wait = Snappoll;
+    }
+    return wait;
+}
+
+
+// Walflush writes out the records buffered since the last flush
+// and, if it is time for one, fsyncs them. The server calls this
+// once per pass of its event loop, and holds back any reply while
+// walpending says it must wait (see protflush), so every record is
+// on disk (and synced, under -f0) before the client hears about it,
+// and one write and one fsync cover all the commands of a pass.
+// On failure, walflush disables w.
+void
+walflush(Wal *w)
+{
+    int64 t;
+
+    if (!w->use) return;
+    if (w->cur->wlen) {
+        t = nanoseconds();
+        if (!filewflush(w->cur)) {
+            filewclose(w->cur);
+            w->use = 0;
+            return;
         }
-        walsync(w);
+        histadd(&w->flushhist, nanoseconds() - t);
     }
+    walsync(w);
 }
 
 
-static int
-makenextfile(Wal *w)
+// Walpending returns 1 if records have been written to w that
+// walflush has yet to make durable enough to reply about: written
+// out, and under -f0, synced.
+int
+walpending(Wal *w)
 {
-    File *f;
+    if (!w->use) return 0;
+    if (w->cur->wlen) return 1;
+    return w->wantsync && !w->syncrate && w->syncrec != w->nrec;
+}
 
-    f = new(File);
-    if (!f) {
-        twarnx("OOM");
-        return 0;
-    }
 
-    if (!fileinit(f, w, w->next)) {
-        free(f);
-        twarnx("OOM");
-        return 0;
+// Walspill frees j's body, if j's full record is in w, so that the body
+// is read back from the log when it's needed (see job_readbody).
+void
+walspill(Wal *w, job j)
+{
+    if (!w->use || !j->file || !j->body) return;
+    if (j->file == w->cur && w->cur->wlen && !filewflush(w->cur)) {
+        filewclose(w->cur);
+        w->use = 0;
+        return;
     }
+    job_dropbody(j);
+}
 
-    filewopen(f);
-    if (!f->iswopen) {
-        free(f->path);
-        free(f);
-        return 0;
+
+// Walunspill brings j's body back into memory after walspill,
+// unless it is big enough that -B keeps it on disk anyway.
+void
+walunspill(Wal *w, job j)
+{
+    if (j->body) return;
+    if (w->bigbody && j->r.body_size >= w->bigbody) return;
+    job_loadbody(j); // if this fails, it can still be sent from the log
+}
+
+
+// Makenextfile adds a new file to w, taking a spare if there is one.
+// Spares are numbered in the order they were made, and a new file is
+// only made here when there are none left, so files stay in order.
+static int
+makenextfile(Wal *w)
+{
+    File *f;
+
+    f = w->spare;
+    if (f) {
+        w->spare = f->next;
+        f->next = NULL;
+        w->nspares--;
+    } else {
+        f = newfile(w);
+        if (!f) return 0;
     }
 
-    w->next++;
     fileadd(f, w);
     return 1;
 }
@@ -271,7 +495,7 @@ static int
 balancerest(Wal *w, File *b, int n)
 {
     int rest, c, r;
-    static const int z = sizeof(int) + sizeof(Jobrec);
+    static const int z = sizeof(int) + sizeof(Walrec);
 
     if (!b) return 1;
 
@@ -366,23 +590,60 @@ reserve(Wal *w, int n)
 }
 
 
-// Returns the number of bytes reserved or 0 on error.
-int
-walresvput(Wal *w, job j)
+static int
+putsize(job j)
 {
     int z = 0;
 
-    // reserve space for the initial job record
+    // space for the initial job record
     z += sizeof(int);
     z += strlen(j->tube->name);
-    z += sizeof(Jobrec);
+    z += sizeof(Walrec);
     z += j->r.body_size;
 
     // plus space for a delete to come later
     z += sizeof(int);
-    z += sizeof(Jobrec);
+    z += sizeof(Walrec);
+    return z;
+}
 
-    return reserve(w, z);
+
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvput(Wal *w, job j)
+{
+    return reserve(w, putsize(j));
+}
+
+
+// Reserves space for n new jobs at once, and sets walresv
+// for each of them.
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvputn(Wal *w, job *jobs, int n)
+{
+    int i;
+    int64 z = 0;
+
+    if (!w->use) {
+        for (i = 0; i < n; i++) jobs[i]->walresv = 1;
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) z += putsize(jobs[i]);
+
+    // a reservation must fit in one file
+    if (z > w->filesize / 2) {
+        for (i = 0; i < n; i++) {
+            jobs[i]->walresv = walresvput(w, jobs[i]);
+            if (!jobs[i]->walresv) return 0;
+        }
+        return z;
+    }
+
+    if (!reserve(w, z)) return 0;
+    for (i = 0; i < n; i++) jobs[i]->walresv = putsize(jobs[i]);
+    return z;
 }
 
 
@@ -393,11 +654,36 @@ walresvupdate(Wal *w, job j)
     int z = 0;
 
     z +=sizeof(int);
-    z +=sizeof(Jobrec);
+    z +=sizeof(Walrec);
     return reserve(w, z);
 }
 
 
+// Reserves space for an update record for each of n jobs at once,
+// and adds it to walresv for each of them.
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvupdaten(Wal *w, job *jobs, int n)
+{
+    int i, z;
+
+    z = sizeof(int) + sizeof(Walrec);
+
+    // a reservation must fit in one file
+    if (w->use && (int64)z * n > w->filesize / 2) {
+        for (i = 0; i < n; i++) {
+            if (!reserve(w, z)) return 0;
+            jobs[i]->walresv += z;
+        }
+        return z * n;
+    }
+
+    if (!reserve(w, z * n)) return 0;
+    for (i = 0; i < n; i++) jobs[i]->walresv += w->use ? z : 1;
+    return z * n;
+}
+
+
 // Returns the number of locks acquired: either 0 or 1.
 int
 waldirlock(Wal *w)
@@ -438,12 +724,45 @@ waldirlock(Wal *w)
 }
 
 
+// Prefetch asks the kernel to start reading binlog file n
+// in the background, so that its I/O overlaps with parsing
+// the file before it.
+static void
+prefetch(Wal *w, int n)
+{
+#ifdef POSIX_FADV_WILLNEED
+    int fd;
+    char *path;
+
+    if (n >= w->next) return;
+    path = fmtalloc("%s/binlog.%d", w->dir, n);
+    if (!path) return;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return;
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+
+// Walread reads the log files numbered from min into list.
+// If there is a snapshot, and the file where it leaves off is still
+// here, the jobs in earlier files come from the snapshot instead,
+// and only the records after that point are replayed.
 void
 walread(Wal *w, job list, int min)
 {
     File *f;
-    int i, fd;
-    int err = 0;
+    int i, fd, off;
+    int err = 0, snap;
+    Snap s;
+
+    snap = snapopen(&s, w);
+    if (snap && (s.seq < min || s.seq >= w->next)) {
+        snapclose(&s);
+        snap = 0;
+    }
 
     for (i = min; i < w->next; i++) {
         f = new(File);
@@ -463,12 +782,27 @@ walread(Wal *w, job list, int min)
             twarn("open %s", f->path);
             free(f->path);
             free(f);
+        } else {
+            fileadd(f, w);
+        }
+
+        off = 0;
+        if (snap && i == s.seq) {
+            snapload(&s, w, list);
+            snapclose(&s);
+            snap = 0;
+            off = s.off;
+        }
+        if (fd < 0) continue;
+        if (snap) {
+            // its jobs come from the snapshot
+            close(fd);
             continue;
         }
 
+        prefetch(w, i+1);
         f->fd = fd;
-        fileadd(f, w);
-        err |= fileread(f, list);
+        err |= fileread(f, list, off);
         close(fd);
     }
 